@@ -2,11 +2,27 @@
 #include <cmath>
 #include <cstring>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <iostream>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <png.h>
 #include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
 float constexpr eps = std::numeric_limits<float>::epsilon() * 250.0;
@@ -112,30 +128,381 @@ std::array<uint8_t, 4> to_uints(std::array<float, 3> const& data)
     return result;
 }
 
+//
+// Threading
+//
+// Calls f for every index on all cores. The first exception thrown by f stops the remaining indices from being
+// handed out and is rethrown on the calling thread once the workers are joined.
+template <typename F> void parallel_for(size_t count, F const& f)
+{
+    size_t const workers = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<size_t> next{0};
+    std::exception_ptr error{};
+    std::mutex error_mutex{};
+    std::vector<std::thread> threads{};
+    for (size_t w = 0; w < workers; w++) {
+        threads.emplace_back([&]() {
+            try {
+                for (size_t i = next++; i < count; i = next++) {
+                    f(i);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{error_mutex};
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+//
+// Sampling
+//
+float constexpr pi = 3.14159265358979323846f;
+
+// splitmix64 finalizer
+constexpr uint64_t hash(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// PCG32
+class Rng
+{
+    uint64_t state;
+
+public:
+    explicit Rng(uint64_t seed) : state{hash(seed)} {}
+    Rng(const Rng&) = delete;
+    Rng(Rng&&) = default;
+    Rng& operator=(const Rng&) = delete;
+    Rng& operator=(Rng&&) = default;
+
+    uint32_t next_uint()
+    {
+        uint64_t const old = state;
+        state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t const xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        uint32_t const rotation = static_cast<uint32_t>(old >> 59);
+        return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+    }
+    float next_float() { return static_cast<float>(next_uint() >> 8) * 0x1p-24f; }
+};
+
+// Orthonormal basis around a unit vector (Duff et al. 2017).
+std::array<vec3, 2> tangent_frame(vec3 const& n)
+{
+    float const sign = std::copysign(1.0f, n[2]);
+    float const a = -1.0f / (sign + n[2]);
+    float const b = n[0] * n[1] * a;
+    return {
+        {{1.0f + sign * n[0] * n[0] * a, sign * b, -sign * n[0]}, {b, sign + n[1] * n[1] * a, -n[1]}}
+    };
+}
+
+vec3 cosine_sample_hemisphere(vec3 const& n, float u1, float u2)
+{
+    float const r = std::sqrt(u1);
+    float const phi = 2.0f * pi * u2;
+    auto const [tangent, bitangent] = tangent_frame(n);
+    return r * std::cos(phi) * tangent + r * std::sin(phi) * bitangent + std::sqrt(std::max(0.0f, 1.0f - u1)) * n;
+}
+
+//
+// Samplers
+//
+// Owen scrambled Sobol points (Burley 2020) shared by every pixel, each pixel rotated by a blue-noise offset
+// (Georgiev and Fajardo 2016) so that the remaining error is spread as high frequency noise across the image.
+// Every get_1d/get_2d call consumes a new dimension with its own shuffle, padding the two Sobol dimensions.
+//
+constexpr uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    return __builtin_bswap32(x);
+}
+
+constexpr uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+constexpr uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Second Sobol dimension (polynomial x + 1) as xor tables, one per index byte, holding the bit reversed direction
+// numbers since the scramble below works on reversed values.
+constexpr std::array<std::array<uint32_t, 256>, 4> sobol_tables = []() {
+    std::array<uint32_t, 32> directions{};
+    directions[0] = 1u << 31;
+    for (size_t k = 1; k < 32; k++) {
+        directions[k] = directions[k - 1] ^ (directions[k - 1] >> 1);
+    }
+    for (auto& direction : directions) {
+        direction = reverse_bits(direction);
+    }
+    std::array<std::array<uint32_t, 256>, 4> tables{};
+    for (size_t byte = 0; byte < 4; byte++) {
+        for (size_t value = 0; value < 256; value++) {
+            for (size_t bit = 0; bit < 8; bit++) {
+                if (value & (1u << bit)) {
+                    tables[byte][value] ^= directions[byte * 8 + bit];
+                }
+            }
+        }
+    }
+    return tables;
+}();
+
+// Bit reversed first two Sobol dimensions, the first being van der Corput.
+constexpr uint32_t reversed_sobol(uint32_t index, size_t dimension)
+{
+    if (dimension == 0) {
+        return index;
+    }
+    return sobol_tables[0][index & 0xff] ^ sobol_tables[1][(index >> 8) & 0xff] ^
+           sobol_tables[2][(index >> 16) & 0xff] ^ sobol_tables[3][index >> 24];
+}
+
+constexpr float to_unit_float(uint32_t x) { return static_cast<float>(x >> 8) * 0x1p-24f; }
+
+// Tileable blue-noise ranks built once by repeatedly filling the largest void, the second half of void-and-cluster
+// (Ulichney 1993).
+class BlueNoise
+{
+    static constexpr size_t Size = 64;
+    std::array<float, Size * Size> values;
+
+public:
+    BlueNoise() : values{}
+    {
+        float constexpr sigma = 1.5f;
+        std::array<float, Size * Size> kernel{};
+        for (size_t dy = 0; dy < Size; dy++) {
+            for (size_t dx = 0; dx < Size; dx++) {
+                float const wx = static_cast<float>(std::min(dx, Size - dx));
+                float const wy = static_cast<float>(std::min(dy, Size - dy));
+                kernel[dy * Size + dx] = std::exp(-(wx * wx + wy * wy) / (2.0f * sigma * sigma));
+            }
+        }
+
+        // a little jitter breaks ties between equally empty pixels
+        Rng rng{64};
+        std::array<float, Size * Size> energy{};
+        std::array<bool, Size * Size> filled{};
+        for (auto& e : energy) {
+            e = rng.next_float() * 1e-6f;
+        }
+        for (size_t rank = 0; rank < Size * Size; rank++) {
+            size_t best{0};
+            float best_energy{std::numeric_limits<float>::max()};
+            for (size_t k = 0; k < Size * Size; k++) {
+                if (!filled[k] && energy[k] < best_energy) {
+                    best = k;
+                    best_energy = energy[k];
+                }
+            }
+            filled[best] = true;
+            values[best] = (static_cast<float>(rank) + 0.5f) / static_cast<float>(Size * Size);
+            size_t const bx = best % Size;
+            size_t const by = best / Size;
+            for (size_t y = 0; y < Size; y++) {
+                for (size_t x = 0; x < Size; x++) {
+                    energy[y * Size + x] += kernel[((y + Size - by) % Size) * Size + (x + Size - bx) % Size];
+                }
+            }
+        }
+    }
+    BlueNoise(const BlueNoise&) = delete;
+    BlueNoise(BlueNoise&&) = delete;
+    BlueNoise& operator=(const BlueNoise&) = delete;
+    BlueNoise& operator=(BlueNoise&&) = delete;
+
+    float get(size_t x, size_t y) const { return values[(y % Size) * Size + x % Size]; }
+
+    static BlueNoise const& instance()
+    {
+        static BlueNoise const noise{};
+        return noise;
+    }
+};
+
+enum class SamplePattern { Random, Sobol };
+
+class Sampler
+{
+    SamplePattern pattern;
+    uint32_t x;
+    uint32_t y;
+    uint32_t index;
+    uint32_t dimension;
+    Rng rng;
+
+    // low half of the dimension hash seeds the scramble, the high half picks the blue-noise tile shift
+    float sobol_component(uint32_t shuffled, uint64_t dimension_hash, uint32_t component) const
+    {
+        uint32_t const seed = static_cast<uint32_t>(dimension_hash) + component;
+        uint32_t const scrambled = laine_karras_permutation(reversed_sobol(shuffled, component), seed);
+        float const u = to_unit_float(reverse_bits(scrambled));
+        uint64_t const shift = dimension_hash >> (32 + 16 * component);
+        float const rotated = u + BlueNoise::instance().get(x + (shift & 0xff), y + ((shift >> 8) & 0xff));
+        return rotated < 1.0f ? rotated : rotated - 1.0f;
+    }
+
+public:
+    Sampler(SamplePattern pattern, uint32_t x, uint32_t y, uint32_t index)
+        : pattern{pattern}, x{x}, y{y}, index{index}, dimension{0}, rng{(hash(x) ^ (uint64_t{y} << 32)) + index}
+    {
+    }
+    Sampler(const Sampler&) = delete;
+    Sampler(Sampler&&) = default;
+    Sampler& operator=(const Sampler&) = delete;
+    Sampler& operator=(Sampler&&) = default;
+
+    float get_1d()
+    {
+        float result{};
+        if (pattern == SamplePattern::Random) {
+            result = rng.next_float();
+        } else {
+            uint64_t const dimension_hash = hash(dimension);
+            uint32_t const shuffled = nested_uniform_scramble(index, static_cast<uint32_t>(dimension_hash >> 16));
+            result = sobol_component(shuffled, dimension_hash, 0);
+        }
+        dimension++;
+        return result;
+    }
+
+    std::array<float, 2> get_2d()
+    {
+        std::array<float, 2> result{};
+        if (pattern == SamplePattern::Random) {
+            result = {rng.next_float(), rng.next_float()};
+        } else {
+            uint64_t const dimension_hash = hash(dimension);
+            uint32_t const shuffled = nested_uniform_scramble(index, static_cast<uint32_t>(dimension_hash >> 16));
+            result = {sobol_component(shuffled, dimension_hash, 0), sobol_component(shuffled, dimension_hash, 1)};
+        }
+        dimension++;
+        return result;
+    }
+};
+
 //
 // Image
 //
 enum ImageChannelType { RGB = 3, RGBA = 4 };
 
+// Leading page of a memory mapped framebuffer file. The pixels follow at data_offset, page aligned, as height rows
+// of width pixels with channels interleaved 8 bit samples each, rows in png order. Fields are in host byte order.
+struct FramebufferHeader {
+    static constexpr size_t DataOffset = 4096;
+
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint64_t data_offset;
+};
+
+// Framebuffer file of any size, created or truncated at path and mapped shared. Writes land in page cache pages
+// that the kernel flushes to the file as it sees fit, so images larger than memory can be rendered into it.
+class MappedFramebuffer
+{
+    void* mapping;
+    size_t mapping_size;
+    size_t row_size;
+
+public:
+    MappedFramebuffer(MappedFramebuffer const&) = delete;
+    MappedFramebuffer(MappedFramebuffer&&) = delete;
+    MappedFramebuffer& operator=(MappedFramebuffer const&) = delete;
+    MappedFramebuffer& operator=(MappedFramebuffer&&) = delete;
+    MappedFramebuffer(std::string const& path, size_t width, size_t height, ImageChannelType channels)
+        : mapping{nullptr}, mapping_size{FramebufferHeader::DataOffset + width * height * channels},
+          row_size{width * channels}
+    {
+        if (width > UINT32_MAX || height > UINT32_MAX) {
+            throw 2;
+        }
+        int const fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw 1;
+        }
+        if (ftruncate(fd, static_cast<off_t>(mapping_size)) != 0) {
+            close(fd);
+            throw 2;
+        }
+        mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw 3;
+        }
+        FramebufferHeader const header{{'B', 'B', '2', 'F', 'R', 'A', 'M', 'E'},
+                                       1,
+                                       static_cast<uint32_t>(width),
+                                       static_cast<uint32_t>(height),
+                                       channels,
+                                       FramebufferHeader::DataOffset};
+        std::memcpy(mapping, &header, sizeof(header));
+    }
+    ~MappedFramebuffer() { munmap(mapping, mapping_size); }
+
+    uint8_t* row(size_t index) const
+    {
+        return static_cast<uint8_t*>(mapping) + FramebufferHeader::DataOffset + index * row_size;
+    }
+};
+
 template <size_t Width, size_t Height, ImageChannelType Channels> class Image
 {
     // clang-format off
-    std::unique_ptr<
+    using Pixels = std::array<
         std::array<
-            std::array<
-                std::array<uint8_t, Channels>, 
-                Width
-            >, 
-            Height
-        >
-    > data;
+            std::array<uint8_t, Channels>,
+            Width
+        >,
+        Height
+    >;
     // clang-format on
+    std::unique_ptr<Pixels> owned;
+    std::unique_ptr<MappedFramebuffer> mapped;
+    Pixels* data;
+
 public:
     Image(Image const&) = delete;
     Image(Image&&) = delete;
     Image& operator=(Image const&) = delete;
     Image& operator=(Image&&) = delete;
-    Image() : data{std::make_unique<std::array<std::array<std::array<uint8_t, Channels>, Width>, Height>>()} {}
+    Image() : owned{std::make_unique<Pixels>()}, mapped{}, data{owned.get()} {}
+    // Pixels live in the MappedFramebuffer file at path.
+    explicit Image(std::string const& path)
+        : owned{}, mapped{std::make_unique<MappedFramebuffer>(path, Width, Height, Channels)},
+          data{reinterpret_cast<Pixels*>(mapped->row(0))}
+    {
+    }
 
     void save(std::string const& filename)
     {
@@ -183,7 +550,150 @@ public:
 
     void set(size_t row, size_t col, std::array<uint8_t, Channels> const& val)
     {
-        std::memcpy((*data.get())[row][col].data(), val.data(), sizeof(uint8_t) * Channels);
+        std::memcpy((*data)[row][col].data(), val.data(), sizeof(uint8_t) * Channels);
+    }
+
+    std::array<uint8_t, Channels> const& get(size_t row, size_t col) const { return (*data)[row][col]; }
+};
+
+// PNG encoder fed a few rows at a time, so images far larger than memory can be written band by band.
+class PngRowWriter
+{
+    FILE* file_ptr;
+    png_structp write_ptr;
+    png_infop info_ptr;
+    size_t width;
+
+public:
+    PngRowWriter(PngRowWriter const&) = delete;
+    PngRowWriter& operator=(PngRowWriter const&) = delete;
+    PngRowWriter(std::string const& filename, size_t width, size_t height)
+        : file_ptr{fopen(filename.c_str(), "wb")}, write_ptr{nullptr}, info_ptr{nullptr}, width{width}
+    {
+        if (file_ptr == nullptr) {
+            throw 1;
+        }
+        write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if (!write_ptr) {
+            fclose(file_ptr);
+            throw 2;
+        }
+        png_init_io(write_ptr, file_ptr);
+        info_ptr = png_create_info_struct(write_ptr);
+        if (!info_ptr) {
+            png_destroy_write_struct(&write_ptr, (png_infopp)NULL);
+            fclose(file_ptr);
+            throw 3;
+        }
+        png_set_IHDR(
+            write_ptr,
+            info_ptr,
+            width,
+            height,
+            sizeof(uint8_t) * 8,
+            PNG_COLOR_TYPE_RGBA,
+            PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT,
+            PNG_FILTER_TYPE_DEFAULT
+        );
+        png_write_info(write_ptr, info_ptr);
+    }
+    ~PngRowWriter()
+    {
+        png_write_end(write_ptr, info_ptr);
+        png_destroy_write_struct(&write_ptr, &info_ptr);
+        fclose(file_ptr);
+    }
+
+    // rows holds count rows of width rgba pixels back to back
+    void write(std::vector<uint8_t> const& rows, size_t count)
+    {
+        assert(rows.size() >= count * width * 4);
+        for (size_t i = 0; i < count; i++) {
+            png_write_row(write_ptr, const_cast<png_bytep>(rows.data() + i * width * 4));
+        }
+    }
+};
+
+//
+// Frame streams
+//
+// Uncompressed frames written back to back to a file, a named pipe or stdout ("-") so that a video encoder can
+// consume a sequence without intermediate files. Raw frames are bare rgb or rgba rows in png order. Y4M frames
+// carry a stream header and are converted to full chroma BT.601 studio range YCbCr. Each frame is assembled in
+// memory and handed to stdio in a single write.
+//
+enum class OutputFormat { Png, Rgb, Rgba, Y4m };
+
+class FrameStream
+{
+    static constexpr size_t BufferSize = 4 << 20;
+
+    FILE* file;
+    bool owned;
+    OutputFormat format;
+    size_t width;
+    size_t height;
+    std::vector<uint8_t> frame;
+
+public:
+    FrameStream(FrameStream const&) = delete;
+    FrameStream& operator=(FrameStream const&) = delete;
+    FrameStream(std::string const& path, OutputFormat format, size_t width, size_t height, size_t fps)
+        : file{path == "-" ? stdout : fopen(path.c_str(), "wb")}, owned{path != "-"}, format{format}, width{width},
+          height{height}, frame{}
+    {
+        if (file == nullptr) {
+            throw 1;
+        }
+        setvbuf(file, nullptr, _IOFBF, BufferSize);
+        if (format == OutputFormat::Y4m) {
+            fprintf(file, "YUV4MPEG2 W%zu H%zu F%zu:1 Ip A1:1 C444\n", width, height, fps);
+        }
+    }
+    ~FrameStream()
+    {
+        fflush(file);
+        if (owned) {
+            fclose(file);
+        }
+    }
+
+    template <size_t Width, size_t Height> void write(Image<Width, Height, ImageChannelType::RGBA> const& img)
+    {
+        assert(Width == width && Height == height);
+        size_t const pixels = Width * Height;
+        if (format == OutputFormat::Y4m) {
+            constexpr char const header[] = "FRAME\n";
+            frame.resize(sizeof(header) - 1 + 3 * pixels);
+            std::memcpy(frame.data(), header, sizeof(header) - 1);
+            uint8_t* const y_plane = frame.data() + sizeof(header) - 1;
+            uint8_t* const cb_plane = y_plane + pixels;
+            uint8_t* const cr_plane = cb_plane + pixels;
+            for (size_t row = 0; row < Height; row++) {
+                for (size_t col = 0; col < Width; col++) {
+                    auto const& pixel = img.get(row, col);
+                    float const r = pixel[0] / 255.0f;
+                    float const g = pixel[1] / 255.0f;
+                    float const b = pixel[2] / 255.0f;
+                    size_t const k = row * Width + col;
+                    y_plane[k] = static_cast<uint8_t>(16.0f + 65.481f * r + 128.553f * g + 24.966f * b + 0.5f);
+                    cb_plane[k] = static_cast<uint8_t>(128.0f - 37.797f * r - 74.203f * g + 112.0f * b + 0.5f);
+                    cr_plane[k] = static_cast<uint8_t>(128.0f + 112.0f * r - 93.786f * g - 18.214f * b + 0.5f);
+                }
+            }
+        } else {
+            size_t const channels = format == OutputFormat::Rgba ? 4 : 3;
+            frame.resize(channels * pixels);
+            for (size_t row = 0; row < Height; row++) {
+                for (size_t col = 0; col < Width; col++) {
+                    std::memcpy(&frame[channels * (row * Width + col)], img.get(row, col).data(), channels);
+                }
+            }
+        }
+        if (fwrite(frame.data(), 1, frame.size(), file) != frame.size()) {
+            throw 2;
+        }
     }
 };
 
@@ -191,12 +701,22 @@ struct Ray {
     vec3 origin;
     vec3 direction;
     float t;
+    // point in the shutter interval, 0 at open and 1 at close
+    float time;
+    // Reciprocal direction and whether each component is negative, set up once per ray for the slab tests of
+    // the acceleration structures. Zero components give infinities of the sign of the zero.
+    vec3 inverse_direction;
+    std::array<uint32_t, 3> sign;
 
     explicit Ray(vec3 const& origin, vec3 const& direction)
-        : origin{origin}, direction{direction}, t{std::numeric_limits<float>::max()}
+        : origin{origin}, direction{direction}, t{std::numeric_limits<float>::max()}, time{0.0},
+          inverse_direction{1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2]},
+          sign{std::signbit(inverse_direction[0]), std::signbit(inverse_direction[1]),
+               std::signbit(inverse_direction[2])}
     {
     }
-    Ray() : origin{}, direction{}, t{std::numeric_limits<float>::max()} {}
+    explicit Ray(vec3 const& origin, vec3 const& direction, float time) : Ray(origin, direction) { this->time = time; }
+    Ray() : Ray(vec3{}, vec3{}) {}
     Ray(const Ray&) = default;
     Ray(Ray&&) = default;
     Ray& operator=(const Ray&) = default;
@@ -205,6 +725,90 @@ struct Ray {
     vec3 hit_position() { return origin + t * direction; }
 };
 
+//
+// Bounding boxes
+//
+struct AABB {
+    vec3 min;
+    vec3 max;
+
+    // empty until extended
+    AABB() : min{}, max{}
+    {
+        min.fill(std::numeric_limits<float>::max());
+        max.fill(-std::numeric_limits<float>::max());
+    }
+    explicit AABB(vec3 const& min, vec3 const& max) : min{min}, max{max} {}
+    AABB(const AABB&) = default;
+    AABB(AABB&&) = default;
+    AABB& operator=(const AABB&) = default;
+    AABB& operator=(AABB&&) = default;
+
+    void extend(vec3 const& point)
+    {
+        for (size_t axis = 0; axis < 3; axis++) {
+            min[axis] = std::min(min[axis], point[axis]);
+            max[axis] = std::max(max[axis], point[axis]);
+        }
+    }
+    // Union, an empty box leaves this one unchanged.
+    void extend(AABB const& box)
+    {
+        for (size_t axis = 0; axis < 3; axis++) {
+            min[axis] = std::min(min[axis], box.min[axis]);
+            max[axis] = std::max(max[axis], box.max[axis]);
+        }
+    }
+
+    bool empty() const { return min[0] > max[0] || min[1] > max[1] || min[2] > max[2]; }
+
+    // Half the surface area, all the surface area heuristic needs.
+    float half_area() const
+    {
+        vec3 const extent = max - min;
+        return extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0];
+    }
+
+    AABB intersection(AABB const& box) const
+    {
+        AABB result{};
+        for (size_t axis = 0; axis < 3; axis++) {
+            result.min[axis] = std::max(min[axis], box.min[axis]);
+            result.max[axis] = std::min(max[axis], box.max[axis]);
+        }
+        return result;
+    }
+
+    // Slab test against the part of the ray in front of ray.t.
+    bool hit(Ray const& ray) const
+    {
+        float near{0.0};
+        float far{ray.t};
+        return clip(ray, near, far);
+    }
+
+    // Box at time between open and close. Contains a linearly moving object whose bounds at shutter open and close
+    // are open and close.
+    static AABB interpolate(AABB const& open, AABB const& close, float time)
+    {
+        return AABB{open.min + time * (close.min - open.min), open.max + time * (close.max - open.max)};
+    }
+
+    // Narrows [near, far] to the part of the ray inside the box, false once it is empty. Branchless: the ray's
+    // sign bits pick the near and far plane of every slab so the three axes need no swap and no early exit, and
+    // min / max with the running interval first skip the NaN of a zero direction component inside its slab.
+    bool clip(Ray const& ray, float& near, float& far) const
+    {
+        for (size_t axis = 0; axis < 3; axis++) {
+            float const entry = (ray.sign[axis] ? max[axis] : min[axis]) - ray.origin[axis];
+            float const exit = (ray.sign[axis] ? min[axis] : max[axis]) - ray.origin[axis];
+            near = std::max(near, entry * ray.inverse_direction[axis]);
+            far = std::min(far, exit * ray.inverse_direction[axis]);
+        }
+        return near <= far;
+    }
+};
+
 struct Material {
     vec3 color;
     float ambient;
@@ -218,12 +822,88 @@ struct Material {
     Material& operator=(Material&&) = default;
 };
 
+struct Object;
+
+// Closest hit found so far. The primitive test that shortens ray.t fills it in with what it computed on the way, so
+// shading reads the surface off the record instead of asking the object again.
+struct Hit {
+    float t;
+    Object const* object;
+    Material const* material;
+    // triangle within the object, 0 for objects with a single surface
+    uint32_t primitive;
+    // barycentric weights of the second and third corner of that triangle, 0 for other surfaces
+    float u;
+    float v;
+    // unit geometric normal
+    vec3 normal;
+
+    Hit() : t{}, object{}, material{}, primitive{}, u{}, v{}, normal{} {};
+    Hit(const Hit&) = default;
+    Hit(Hit&&) = default;
+    Hit& operator=(const Hit&) = default;
+    Hit& operator=(Hit&&) = default;
+
+    // Owner of the surface the geometry was just recorded for, true so primitive tests can chain it.
+    bool on(Object const* hit_object, Material const& hit_material)
+    {
+        object = hit_object;
+        material = &hit_material;
+        return true;
+    }
+};
+
 struct Object {
-    virtual bool hit(Ray& ray) const = 0;
-    virtual vec3 normal(vec3 const& hit_position) const = 0;
+    // Shortens ray.t to a closer hit and records it, leaves both alone otherwise.
+    virtual bool hit(Ray& ray, Hit& record) const = 0;
     virtual Material const& material() const = 0;
+    // Bounds over the whole shutter interval.
+    virtual AABB bounds() const = 0;
+    virtual bool moving() const { return false; }
+    // Bounds at a point in the shutter interval, moving objects override it.
+    virtual AABB bounds_at(float) const { return bounds(); }
+    // Bounds of the parts of the object inside box either side of the plane at position along axis, empty for a
+    // side the object does not reach. Clipping the box is conservative, primitives override it with a tighter fit.
+    virtual std::array<AABB, 2> split_bounds(AABB const& box, size_t axis, float position) const
+    {
+        std::array<AABB, 2> parts{box, box};
+        parts[0].max[axis] = std::min(box.max[axis], position);
+        parts[1].min[axis] = std::max(box.min[axis], position);
+        return parts;
+    }
 };
 
+// Records the hit at ray.t with its normal, primitive and barycentrics reset for surfaces that have none.
+void record_surface(Ray const& ray, vec3 const& normal, Hit& record)
+{
+    record.t = ray.t;
+    record.primitive = 0;
+    record.u = 0.0;
+    record.v = 0.0;
+    record.normal = normal;
+}
+
+bool hit_sphere(vec3 const& position, float radius, Ray& ray, Hit& record)
+{
+    vec3 h = position - ray.origin;
+    float m = dot(h, ray.direction);
+    float g = m * m - dot(h, h) + radius * radius;
+    if (g < 0) {
+        return false;
+    }
+    float t0 = m - sqrt(g);
+    float t1 = m + sqrt(g);
+    if (t0 > eps && t0 < ray.t) {
+        ray.t = t0;
+    } else if (t1 > eps && t1 < ray.t) {
+        ray.t = t1;
+    } else {
+        return false;
+    }
+    record_surface(ray, normalize(ray.hit_position() - position), record);
+    return true;
+}
+
 class Sphere : public Object
 {
     vec3 position;
@@ -238,33 +918,87 @@ public:
     Sphere& operator=(const Sphere&) = delete;
     Sphere& operator=(Sphere&&) = default;
 
-    bool hit(Ray& ray) const
-    {
-        vec3 h = position - ray.origin;
-        float m = dot(h, ray.direction);
-        float g = m * m - dot(h, h) + radius * radius;
-        if (g < 0) {
-            return false;
-        }
-        float t0 = m - sqrt(g);
-        float t1 = m + sqrt(g);
-        if (t0 > eps && t0 < ray.t) {
-            ray.t = t0;
-            return true;
-        } else if (t1 > eps && t1 < ray.t) {
-            ray.t = t1;
-            return true;
-        }
-        return false;
-    }
-    vec3 normal(vec3 const& hit_position) const { return normalize(hit_position - position); };
+    bool hit(Ray& ray, Hit& record) const { return hit_sphere(position, radius, ray, record) && record.on(this, mat); }
 
     Material const& material() const { return mat; }
+    AABB bounds() const
+    {
+        return AABB{position - vec3{radius, radius, radius}, position + vec3{radius, radius, radius}};
+    }
+    vec3 const& get_position() const { return position; }
+    float get_radius() const { return radius; }
 };
 
-class Triangle : public Object
+// Splits a convex polygon at the plane, vertices go to their side and crossing edges add their intersection to
+// both.
+template <size_t N>
+std::array<AABB, 2>
+split_polygon_bounds(std::array<vec3, N> const& vertices, AABB const& box, size_t axis, float position)
 {
-    std::array<vec3, 3> positions;
+    std::array<AABB, 2> parts{};
+    for (size_t k = 0; k < N; k++) {
+        vec3 const& a = vertices[k];
+        vec3 const& b = vertices[(k + 1) % N];
+        if (a[axis] <= position) {
+            parts[0].extend(a);
+        }
+        if (a[axis] >= position) {
+            parts[1].extend(a);
+        }
+        if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+            vec3 crossing = a + ((position - a[axis]) / (b[axis] - a[axis])) * (b - a);
+            crossing[axis] = position;
+            parts[0].extend(crossing);
+            parts[1].extend(crossing);
+        }
+    }
+    return {parts[0].intersection(box), parts[1].intersection(box)};
+}
+
+bool hit_triangle(std::array<vec3, 3> const& positions, Ray& ray, Hit& record)
+{
+    vec3 const e1 = positions[1] - positions[0];
+    vec3 const e2 = positions[2] - positions[0];
+    vec3 const n = cross(e1, e2);
+    float const D = -dot(positions[0], n);
+    float const denominator = dot(n, ray.direction);
+    if (!std::isnormal(denominator)) {
+        return false;
+    }
+    float const time = -(D + dot(n, ray.origin)) / denominator;
+    if (std::signbit(time)) {
+        return false;
+    }
+    if (time <= eps || time >= ray.t) {
+        return false;
+    }
+    vec3 const solution_position = ray.origin + (time * ray.direction);
+    vec3 const ep = solution_position - positions[0];
+    float const d11 = dot(e1, e1);
+    float const d12 = dot(e1, e2);
+    float const d22 = dot(e2, e2);
+    float const d1p = dot(e1, ep);
+    float const d2p = dot(e2, ep);
+    float const det = d11 * d22 - d12 * d12;
+    if (!std::isnormal(det)) {
+        return false;
+    }
+    float const beta = (d22 * d1p - d12 * d2p) / det;
+    float const gamma = (d11 * d2p - d12 * d1p) / det;
+    // float const alpha = 1 - beta - gamma;
+    if (beta < 0.0 || beta > 1.0 || gamma < 0.0 || gamma > 1.0 || beta + gamma > 1.0 || beta + gamma < 0.0) {
+        return false;
+    }
+    ray.t = time;
+    record_surface(ray, normalize(n), record);
+    record.u = beta;
+    record.v = gamma;
+    return true;
+}
+
+class Triangle : public Object
+{
+    std::array<vec3, 3> positions;
 
     Material mat;
 
@@ -275,171 +1009,4382 @@ public:
     Triangle& operator=(const Triangle&) = delete;
     Triangle& operator=(Triangle&&) = default;
 
-    bool hit(Ray& ray) const
+    bool hit(Ray& ray, Hit& record) const { return hit_triangle(positions, ray, record) && record.on(this, mat); }
+
+    Material const& material() const { return mat; }
+    AABB bounds() const
     {
-        vec3 const e1 = positions[1] - positions[0];
-        vec3 const e2 = positions[2] - positions[0];
-        vec3 const n = cross(e1, e2);
-        float const D = -dot(positions[0], n);
-        float const denominator = dot(n, ray.direction);
-        if (!std::isnormal(denominator)) {
-            return false;
+        AABB box{};
+        for (auto const& position : positions) {
+            box.extend(position);
         }
-        float const time = -(D + dot(n, ray.origin)) / denominator;
-        if (std::signbit(time)) {
-            return false;
+        return box;
+    }
+
+    std::array<AABB, 2> split_bounds(AABB const& box, size_t axis, float position) const
+    {
+        return split_polygon_bounds(positions, box, axis, position);
+    }
+    std::array<vec3, 3> const& get_positions() const { return positions; }
+};
+
+// Sphere moving linearly from position_open to position_close over the shutter interval.
+class MovingSphere : public Object
+{
+    vec3 position_open;
+    vec3 position_close;
+    float radius;
+
+    Material mat;
+
+    vec3 position(float time) const { return position_open + time * (position_close - position_open); }
+
+public:
+    MovingSphere(vec3 const& position_open, vec3 const& position_close, float radius, Material const& mat)
+        : position_open(position_open), position_close(position_close), radius(radius), mat(mat)
+    {
+    }
+    MovingSphere(const MovingSphere&) = delete;
+    MovingSphere(MovingSphere&&) = default;
+    MovingSphere& operator=(const MovingSphere&) = delete;
+    MovingSphere& operator=(MovingSphere&&) = default;
+
+    bool hit(Ray& ray, Hit& record) const
+    {
+        return hit_sphere(position(ray.time), radius, ray, record) && record.on(this, mat);
+    }
+
+    Material const& material() const { return mat; }
+    AABB bounds() const
+    {
+        AABB box = bounds_at(0.0);
+        box.extend(bounds_at(1.0));
+        return box;
+    }
+    bool moving() const { return true; }
+    AABB bounds_at(float time) const
+    {
+        vec3 const center = position(time);
+        return AABB{center - vec3{radius, radius, radius}, center + vec3{radius, radius, radius}};
+    }
+};
+
+// Triangle whose vertices move linearly from positions_open to positions_close over the shutter interval.
+class MovingTriangle : public Object
+{
+    std::array<vec3, 3> positions_open;
+    std::array<vec3, 3> positions_close;
+
+    Material mat;
+
+    std::array<vec3, 3> positions(float time) const
+    {
+        std::array<vec3, 3> result{};
+        for (size_t k = 0; k < 3; k++) {
+            result[k] = positions_open[k] + time * (positions_close[k] - positions_open[k]);
         }
-        if (time > eps && time < ray.t) {
-            ray.t = time;
-        } else {
-            return false;
+        return result;
+    }
+
+public:
+    MovingTriangle(
+        std::array<vec3, 3> const& positions_open,
+        std::array<vec3, 3> const& positions_close,
+        Material const& mat
+    )
+        : positions_open(positions_open), positions_close(positions_close), mat(mat)
+    {
+    }
+    MovingTriangle(const MovingTriangle&) = delete;
+    MovingTriangle(MovingTriangle&&) = default;
+    MovingTriangle& operator=(const MovingTriangle&) = delete;
+    MovingTriangle& operator=(MovingTriangle&&) = default;
+
+    bool hit(Ray& ray, Hit& record) const
+    {
+        return hit_triangle(positions(ray.time), ray, record) && record.on(this, mat);
+    }
+
+    Material const& material() const { return mat; }
+    AABB bounds() const
+    {
+        AABB box = bounds_at(0.0);
+        box.extend(bounds_at(1.0));
+        return box;
+    }
+    bool moving() const { return true; }
+    AABB bounds_at(float time) const
+    {
+        AABB box{};
+        for (auto const& position : positions(time)) {
+            box.extend(position);
         }
-        vec3 const solution_position = ray.origin + (time * ray.direction);
-        vec3 const ep = solution_position - positions[0];
-        float const d11 = dot(e1, e1);
-        float const d12 = dot(e1, e2);
-        float const d22 = dot(e2, e2);
-        float const d1p = dot(e1, ep);
-        float const d2p = dot(e2, ep);
-        float const det = d11 * d22 - d12 * d12;
+        return box;
+    }
+};
+
+// Intersects the triangle pair (origin, origin + diagonal, origin + edges[k]) around their shared diagonal. With the
+// diagonal as first edge the two Moller-Trumbore tests (Moller and Trumbore 1997) share the origin offset, its cross
+// product with the diagonal and the barycentric numerator along the second edges. The record gets the index of the
+// triangle hit as its primitive, the caller knows its normal.
+bool hit_triangle_pair(
+    vec3 const& origin,
+    vec3 const& diagonal,
+    std::array<vec3, 2> const& edges,
+    Ray& ray,
+    Hit& record
+)
+{
+    vec3 const s = ray.origin - origin;
+    vec3 const q = cross(s, diagonal);
+    float const v_numerator = dot(ray.direction, q);
+    for (size_t k = 0; k < 2; k++) {
+        vec3 const& edge = edges[k];
+        vec3 const p = cross(ray.direction, edge);
+        float const det = dot(diagonal, p);
         if (!std::isnormal(det)) {
-            return false;
+            continue;
         }
-        float const beta = (d22 * d1p - d12 * d2p) / det;
-        float const gamma = (d11 * d2p - d12 * d1p) / det;
-        // float const alpha = 1 - beta - gamma;
-        if (beta < 0.0 || beta > 1.0 || gamma < 0.0 || gamma > 1.0 || beta + gamma > 1.0 || beta + gamma < 0.0) {
-            return false;
+        float const inverse_det = 1.0f / det;
+        float const u = dot(s, p) * inverse_det;
+        float const v = v_numerator * inverse_det;
+        if (u < 0.0f || v < 0.0f || u + v > 1.0f) {
+            continue;
+        }
+        float const time = dot(edge, q) * inverse_det;
+        if (time <= eps || time >= ray.t) {
+            continue;
         }
+        ray.t = time;
+        record.t = time;
+        record.primitive = static_cast<uint32_t>(k);
+        record.u = u;
+        record.v = v;
         return true;
     }
+    return false;
+}
 
-    vec3 normal(vec3 const& hit_position) const
+// Unit normal of triangle k of the pair, wound like the quad origin, origin + edges[0], origin + diagonal,
+// origin + edges[1] it makes up.
+vec3 triangle_pair_normal(vec3 const& diagonal, std::array<vec3, 2> const& edges, size_t k)
+{
+    return normalize(k == 0 ? cross(edges[0], diagonal) : cross(diagonal, edges[1]));
+}
+
+// Quad v0 v1 v2 v3 intersected as the triangle pair (v0, v2, v1) and (v0, v2, v3) in a single combined test.
+class Quad : public Object
+{
+    vec3 origin;
+    vec3 diagonal;
+    std::array<vec3, 2> edges;
+    std::array<vec3, 2> normals;
+
+    Material mat;
+
+    std::array<vec3, 3> triangle(size_t k) const { return {origin, origin + diagonal, origin + edges[k]}; }
+
+public:
+    Quad(std::array<vec3, 4> const& positions, Material const& mat)
+        : origin(positions[0]), diagonal(positions[2] - positions[0]),
+          edges{positions[1] - positions[0], positions[3] - positions[0]},
+          normals{triangle_pair_normal(diagonal, edges, 0), triangle_pair_normal(diagonal, edges, 1)}, mat(mat)
     {
-        return normalize(cross((hit_position - positions[0]), (positions[2] - positions[0])));
-    };
+    }
+    Quad(const Quad&) = delete;
+    Quad(Quad&&) = default;
+    Quad& operator=(const Quad&) = delete;
+    Quad& operator=(Quad&&) = default;
+
+    bool hit(Ray& ray, Hit& record) const
+    {
+        if (!hit_triangle_pair(origin, diagonal, edges, ray, record)) {
+            return false;
+        }
+        record.normal = normals[record.primitive];
+        return record.on(this, mat);
+    }
 
     Material const& material() const { return mat; }
+    AABB bounds() const
+    {
+        AABB box{};
+        box.extend(origin);
+        box.extend(origin + diagonal);
+        box.extend(origin + edges[0]);
+        box.extend(origin + edges[1]);
+        return box;
+    }
+
+    std::array<AABB, 2> split_bounds(AABB const& box, size_t axis, float position) const
+    {
+        std::array<AABB, 2> parts = split_polygon_bounds(triangle(0), box, axis, position);
+        std::array<AABB, 2> const second = split_polygon_bounds(triangle(1), box, axis, position);
+        parts[0].extend(second[0]);
+        parts[1].extend(second[1]);
+        return parts;
+    }
 };
 
-//
-// Point Light
-//
-struct Light {
-    vec3 position;
-    vec3 color;
+// Axis-aligned box, one slab test instead of twelve triangles.
+class Box : public Object
+{
+    AABB box;
 
-    explicit Light(vec3 const& position, vec3 const& color) : position(position), color(color) {};
-    Light(const Light&) = delete;
-    Light(Light&&) = default;
-    Light& operator=(const Light&) = delete;
-    Light& operator=(Light&&) = default;
+    Material mat;
+
+    // Normal of the face closest to the hit position.
+    vec3 normal(vec3 const& hit_position) const
+    {
+        vec3 result{};
+        float closest{std::numeric_limits<float>::max()};
+        for (size_t axis = 0; axis < 3; axis++) {
+            float const below = std::abs(hit_position[axis] - box.min[axis]);
+            float const above = std::abs(hit_position[axis] - box.max[axis]);
+            if (below < closest) {
+                closest = below;
+                result = {};
+                result[axis] = -1.0;
+            }
+            if (above < closest) {
+                closest = above;
+                result = {};
+                result[axis] = 1.0;
+            }
+        }
+        return result;
+    }
+
+public:
+    Box(vec3 const& min, vec3 const& max, Material const& mat) : box(min, max), mat(mat) {}
+    Box(const Box&) = delete;
+    Box(Box&&) = default;
+    Box& operator=(const Box&) = delete;
+    Box& operator=(Box&&) = default;
+
+    bool hit(Ray& ray, Hit& record) const
+    {
+        float near{-std::numeric_limits<float>::max()};
+        float far{std::numeric_limits<float>::max()};
+        if (!box.clip(ray, near, far)) {
+            return false;
+        }
+        // the exit point is hit from inside
+        if (near > eps && near < ray.t) {
+            ray.t = near;
+        } else if (far > eps && far < ray.t) {
+            ray.t = far;
+        } else {
+            return false;
+        }
+        record_surface(ray, normal(ray.hit_position()), record);
+        return record.on(this, mat);
+    }
+
+    Material const& material() const { return mat; }
+    AABB bounds() const { return box; }
 };
 
-//
-// Scene
-//
-class Scene
+// Infinite plane through position. Planes have no finite bounds, the scene tests them outside its acceleration
+// structures.
+class Plane : public Object
 {
-    std::vector<Light> lights;
+    vec3 n;
+    float offset;
 
-    std::vector<std::unique_ptr<Sphere>> sphere_storage;
-    std::vector<std::unique_ptr<Triangle>> triangle_storage;
-    std::vector<Object*> objects;
+    Material mat;
 
 public:
-    Scene() : lights{}, sphere_storage{}, triangle_storage{}, objects{} {};
-    Scene(const Scene&) = delete;
-    Scene(Scene&&) = delete;
-    Scene& operator=(const Scene&) = delete;
-    Scene& operator=(Scene&&) = delete;
+    Plane(vec3 const& position, vec3 const& normal, Material const& mat)
+        : n(normalize(normal)), offset(dot(n, position)), mat(mat)
+    {
+    }
+    Plane(const Plane&) = delete;
+    Plane(Plane&&) = default;
+    Plane& operator=(const Plane&) = delete;
+    Plane& operator=(Plane&&) = default;
 
-    void push_object(Sphere&& sphere)
+    bool hit(Ray& ray, Hit& record) const
     {
-        sphere_storage.push_back(std::make_unique<Sphere>(std::move(sphere)));
-        objects.push_back(static_cast<Object*>(sphere_storage[sphere_storage.size() - 1].get()));
+        float const denominator = dot(n, ray.direction);
+        if (!std::isnormal(denominator)) {
+            return false;
+        }
+        float const time = (offset - dot(n, ray.origin)) / denominator;
+        if (time <= eps || time >= ray.t) {
+            return false;
+        }
+        ray.t = time;
+        record_surface(ray, n, record);
+        return record.on(this, mat);
     }
 
-    void push_object(Triangle&& triangle)
+    Material const& material() const { return mat; }
+    AABB bounds() const
     {
-        triangle_storage.push_back(std::make_unique<Triangle>(std::move(triangle)));
-        objects.push_back(static_cast<Object*>(triangle_storage[triangle_storage.size() - 1].get()));
+        float constexpr infinity = std::numeric_limits<float>::infinity();
+        return AABB{vec3{-infinity, -infinity, -infinity}, vec3{infinity, infinity, infinity}};
     }
+    vec3 const& get_normal() const { return n; }
+    float get_offset() const { return offset; }
+};
 
-    void push_light(Light&& light) { lights.push_back(std::move(light)); }
+//
+// Lazy tessellation
+//
+// Patches are only diced into micro triangles when a ray first reaches their bounds. The grids live in a geometry
+// cache capped in bytes that evicts the least recently used ones, so scenes can carry far more detail than fits in
+// memory at once, and a patch evicted while a ray is still in it is simply diced again.
+//
 
-    std::vector<Object*> const& get_objects() const { return objects; };
-    std::vector<Light> const& get_lights() const { return lights; };
+// Vertex grid of a diced patch with the bounds of every Block x Block cell square.
+struct Tessellation {
+    static constexpr size_t Block = 8;
+
+    size_t resolution;
+    std::vector<vec3> vertices;
+    std::vector<AABB> blocks;
+
+    size_t blocks_per_side() const { return (resolution + Block - 1) / Block; }
+    vec3 const& vertex(size_t i, size_t j) const { return vertices[i * (resolution + 1) + j]; }
+    size_t memory() const { return vertices.size() * sizeof(vec3) + blocks.size() * sizeof(AABB); }
 };
 
-template <size_t Width, size_t Height, size_t MaxDepth> vec3 ray_trace(Scene const& scene, int i, int j)
+class GeometryCache
 {
-    vec3 color{};
-    float intensity{1.0};
-    Ray ray{
-        {static_cast<float>(i - static_cast<int>(Width / 2)),
-         static_cast<float>(j - static_cast<int>(Height / 2)),
-         -1000.0},
-        {0, 0, 1}
+    // Batched eviction frees down to this fraction of the capacity, so the sort by last use is paid once per batch.
+    static constexpr size_t EvictionSlack = 8;
+
+    // One per key, read without the lock. last_use is the clock at the latest hit, so recency is only tracked to
+    // the resolution of one miss.
+    struct Slot {
+        std::atomic<std::shared_ptr<Tessellation const>> tessellation;
+        std::atomic<uint64_t> last_use;
     };
 
-    for (size_t depth = 0; depth < MaxDepth; depth++) {
-        Object const* hit_object = nullptr;
-        for (auto const object : scene.get_objects()) {
-            if (object->hit(ray)) {
-                hit_object = object;
+    size_t capacity;
+    size_t size;
+    // grows only in new_key, which runs while the scene is built and before any get
+    std::deque<Slot> slots;
+    // keys whose slot holds a tessellation
+    std::vector<uint32_t> resident;
+    std::mutex mutex;
+    std::atomic<uint64_t> clock;
+    size_t misses;
+    size_t evictions;
+
+    // Drops the least recently used tessellations until size is EvictionSlack short of capacity, never the newest.
+    void evict()
+    {
+        auto const last_use = [&](uint32_t key) { return slots[key].last_use.load(std::memory_order_relaxed); };
+        std::sort(resident.begin(), resident.end(), [&](uint32_t a, uint32_t b) { return last_use(a) > last_use(b); });
+        size_t const target = capacity - capacity / EvictionSlack;
+        while (size > target && resident.size() > 1) {
+            Slot& slot = slots[resident.back()];
+            size -= slot.tessellation.load(std::memory_order_relaxed)->memory();
+            slot.tessellation.store(nullptr, std::memory_order_release);
+            resident.pop_back();
+            evictions++;
+        }
+    }
+
+public:
+    explicit GeometryCache(size_t capacity)
+        : capacity{capacity}, size{0}, slots{}, resident{}, mutex{}, clock{0}, misses{0}, evictions{0}
+    {
+    }
+    GeometryCache(const GeometryCache&) = delete;
+    GeometryCache(GeometryCache&&) = delete;
+    GeometryCache& operator=(const GeometryCache&) = delete;
+    GeometryCache& operator=(GeometryCache&&) = delete;
+
+    uint32_t new_key()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        slots.emplace_back();
+        return static_cast<uint32_t>(slots.size() - 1);
+    }
+
+    void set_capacity(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        capacity = bytes;
+    }
+
+    // Cached tessellation for key, made with tessellate outside the lock on a miss. Hits only load the slot and
+    // refresh its stamp, the lock is taken to insert and evict. The most recent entry is kept even when it alone
+    // exceeds the capacity.
+    template <typename F> std::shared_ptr<Tessellation const> get(uint32_t key, F const& tessellate)
+    {
+        Slot& slot = slots[key];
+        if (auto tessellation = slot.tessellation.load(std::memory_order_acquire)) {
+            uint64_t const now = clock.load(std::memory_order_relaxed);
+            // skip the store when already current, so threads hitting the same patch don't write its line
+            if (slot.last_use.load(std::memory_order_relaxed) != now) {
+                slot.last_use.store(now, std::memory_order_relaxed);
             }
+            return tessellation;
         }
-        if (hit_object == nullptr) {
-            return color;
+        auto tessellation = std::make_shared<Tessellation const>(tessellate());
+
+        std::lock_guard<std::mutex> lock{mutex};
+        if (auto existing = slot.tessellation.load(std::memory_order_acquire)) {
+            // another thread diced it meanwhile
+            return existing;
+        }
+        misses++;
+        size += tessellation->memory();
+        slot.last_use.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        slot.tessellation.store(tessellation, std::memory_order_release);
+        resident.push_back(key);
+        if (size > capacity) {
+            evict();
         }
+        return tessellation;
+    }
 
-        vec3 hit_position = ray.hit_position();
-        vec3 const hit_normal = hit_object->normal(hit_position);
-        hit_position += hit_normal * eps;
+    size_t get_misses() const { return misses; }
+    size_t get_evictions() const { return evictions; }
+    size_t get_size() const { return size; }
+};
 
-        Material const& hit_material = hit_object->material();
+// Bicubic Bezier patch, the limit surface of a regular Catmull-Clark face, displaced along its normal by a sine
+// ripple and diced into resolution x resolution cells on demand. Bounds hold the control points, which contain the
+// surface, grown by the displacement amplitude.
+class Patch : public Object
+{
+    using Edges = std::array<vec3, 2>;
 
-        // ambient
-        color += intensity * hit_material.ambient * hit_material.color;
+    std::array<vec3, 16> control_points;
+    float amplitude;
+    float frequency;
+    size_t resolution;
+    GeometryCache& cache;
+    uint32_t key;
+    AABB box;
 
-        // diffuse
-        for (auto const& light : scene.get_lights()) {
-            vec3 light_direction = normalize(light.position - hit_position);
-            float diffuse = dot(hit_normal, light_direction);
-            if (diffuse <= 0.0) {
-                continue;
+    Material mat;
+
+    static std::array<float, 4> bernstein(float t)
+    {
+        float const s = 1.0f - t;
+        return {s * s * s, 3.0f * t * s * s, 3.0f * t * t * s, t * t * t};
+    }
+
+    static std::array<float, 4> bernstein_derivative(float t)
+    {
+        float const s = 1.0f - t;
+        return {-3.0f * s * s, 3.0f * s * s - 6.0f * t * s, 6.0f * t * s - 3.0f * t * t, 3.0f * t * t};
+    }
+
+    vec3 evaluate(float u, float v) const
+    {
+        auto const bu = bernstein(u);
+        auto const bv = bernstein(v);
+        auto const du = bernstein_derivative(u);
+        auto const dv = bernstein_derivative(v);
+        vec3 position{};
+        vec3 tangent_u{};
+        vec3 tangent_v{};
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                vec3 const& point = control_points[i * 4 + j];
+                position += (bu[i] * bv[j]) * point;
+                tangent_u += (du[i] * bv[j]) * point;
+                tangent_v += (bu[i] * dv[j]) * point;
             }
+        }
+        float const height = amplitude * std::sin(2.0f * pi * frequency * u) * std::sin(2.0f * pi * frequency * v);
+        return position + height * normalize(cross(tangent_u, tangent_v));
+    }
 
-            Ray ray_to_light{hit_position, light_direction};
-            bool in_shadow{false};
-            for (auto const object : scene.get_objects()) {
-                if (object->hit(ray_to_light)) {
-                    in_shadow = true;
-                    break;
+    Tessellation tessellate() const
+    {
+        Tessellation result{resolution, std::vector<vec3>((resolution + 1) * (resolution + 1)), {}};
+        float const step = 1.0f / resolution;
+        for (size_t i = 0; i <= resolution; i++) {
+            for (size_t j = 0; j <= resolution; j++) {
+                result.vertices[i * (resolution + 1) + j] = evaluate(i * step, j * step);
+            }
+        }
+        size_t const blocks = result.blocks_per_side();
+        result.blocks.resize(blocks * blocks);
+        for (size_t bi = 0; bi < blocks; bi++) {
+            for (size_t bj = 0; bj < blocks; bj++) {
+                AABB& bounds = result.blocks[bi * blocks + bj];
+                size_t const i1 = std::min((bi + 1) * Tessellation::Block, resolution);
+                size_t const j1 = std::min((bj + 1) * Tessellation::Block, resolution);
+                for (size_t i = bi * Tessellation::Block; i <= i1; i++) {
+                    for (size_t j = bj * Tessellation::Block; j <= j1; j++) {
+                        bounds.extend(result.vertex(i, j));
+                    }
                 }
             }
-            if (!in_shadow) {
-                color += intensity * hit_material.diffuse * diffuse * light.color * hit_material.color;
+        }
+        return result;
+    }
+
+    std::shared_ptr<Tessellation const> tessellation() const
+    {
+        return cache.get(key, [&]() { return tessellate(); });
+    }
+
+    template <typename F> void for_each_cell(Tessellation const& grid, size_t block, F const& f) const
+    {
+        size_t const blocks = grid.blocks_per_side();
+        size_t const i0 = (block / blocks) * Tessellation::Block;
+        size_t const j0 = (block % blocks) * Tessellation::Block;
+        for (size_t i = i0; i < std::min(i0 + Tessellation::Block, resolution); i++) {
+            for (size_t j = j0; j < std::min(j0 + Tessellation::Block, resolution); j++) {
+                vec3 const& origin = grid.vertex(i, j);
+                f(i * resolution + j, origin, grid.vertex(i + 1, j + 1) - origin,
+                  Edges{grid.vertex(i + 1, j) - origin, grid.vertex(i, j + 1) - origin});
             }
         }
-        intensity *= hit_material.reflect;
-        if (intensity < 0.01) {
-            return color;
+    }
+
+public:
+    Patch(
+        std::array<vec3, 16> const& control_points,
+        float amplitude,
+        float frequency,
+        size_t resolution,
+        Material const& mat,
+        GeometryCache& cache
+    )
+        : control_points(control_points), amplitude(amplitude), frequency(frequency),
+          resolution(std::max<size_t>(1, resolution)), cache(cache), key(cache.new_key()), box(), mat(mat)
+    {
+        for (auto const& point : control_points) {
+            box.extend(point);
         }
-        ray = Ray(hit_position, normalize(ray.direction - 2.0 * dot(ray.direction, hit_normal) * hit_normal));
+        float const padding = std::abs(amplitude);
+        box.min = box.min - vec3{padding, padding, padding};
+        box.max = box.max + vec3{padding, padding, padding};
+    }
+    Patch(const Patch&) = delete;
+    Patch(Patch&&) = default;
+    Patch& operator=(const Patch&) = delete;
+    Patch& operator=(Patch&&) = delete;
+
+    // Micro triangles are primitives 2 * cell and 2 * cell + 1, cells numbered row by row.
+    bool hit(Ray& ray, Hit& record) const
+    {
+        // rays that miss the bounds must not dice the patch
+        if (!box.hit(ray)) {
+            return false;
+        }
+        auto const grid = tessellation();
+        bool hit{false};
+        for (size_t block = 0; block < grid->blocks.size(); block++) {
+            if (!grid->blocks[block].hit(ray)) {
+                continue;
+            }
+            for_each_cell(*grid, block, [&](size_t cell, vec3 const& origin, vec3 const& diagonal, Edges const& edges) {
+                if (!hit_triangle_pair(origin, diagonal, edges, ray, record)) {
+                    return;
+                }
+                size_t const k = record.primitive;
+                record.normal = triangle_pair_normal(diagonal, edges, k);
+                record.primitive = static_cast<uint32_t>(2 * cell + k);
+                hit = true;
+            });
+        }
+        return hit && record.on(this, mat);
     }
-    return color;
-}
+
+    Material const& material() const { return mat; }
+    AABB bounds() const { return box; }
+};
 
 //
-// Main
+// Point Light
+//
+struct Light {
+    vec3 position;
+    vec3 color;
+
+    explicit Light(vec3 const& position, vec3 const& color) : position(position), color(color) {};
+    Light(const Light&) = delete;
+    Light(Light&&) = default;
+    Light& operator=(const Light&) = delete;
+    Light& operator=(Light&&) = default;
+};
+
+//
+// Area Lights
+//
+struct AreaLight {
+    // Point on the light for the sample (u1, u2), as seen from position.
+    virtual vec3 sample(vec3 const& position, float u1, float u2) const = 0;
+    virtual vec3 const& get_color() const = 0;
+};
+
+class RectangleLight : public AreaLight
+{
+    vec3 corner;
+    vec3 edge_u;
+    vec3 edge_v;
+    vec3 color;
+
+public:
+    RectangleLight(vec3 const& corner, vec3 const& edge_u, vec3 const& edge_v, vec3 const& color)
+        : corner(corner), edge_u(edge_u), edge_v(edge_v), color(color)
+    {
+    }
+    RectangleLight(const RectangleLight&) = delete;
+    RectangleLight(RectangleLight&&) = default;
+    RectangleLight& operator=(const RectangleLight&) = delete;
+    RectangleLight& operator=(RectangleLight&&) = default;
+
+    vec3 sample(vec3 const&, float u1, float u2) const { return corner + u1 * edge_u + u2 * edge_v; }
+    vec3 const& get_color() const { return color; }
+};
+
+class SphereLight : public AreaLight
+{
+    vec3 position;
+    float radius;
+    vec3 color;
+
+public:
+    SphereLight(vec3 const& position, float radius, vec3 const& color)
+        : position(position), radius(radius), color(color)
+    {
+    }
+    SphereLight(const SphereLight&) = delete;
+    SphereLight(SphereLight&&) = default;
+    SphereLight& operator=(const SphereLight&) = delete;
+    SphereLight& operator=(SphereLight&&) = default;
+
+    // Uniform over the cone the sphere subtends, so no samples land on the far side.
+    vec3 sample(vec3 const& from, float u1, float u2) const
+    {
+        vec3 const to_center = position - from;
+        float const distance_squared = dot(to_center, to_center);
+        if (distance_squared <= radius * radius) {
+            return position;
+        }
+        vec3 const w = to_center * (1.0f / std::sqrt(distance_squared));
+        float const cos_max = std::sqrt(1.0f - radius * radius / distance_squared);
+        float const cos_theta = 1.0f - u1 * (1.0f - cos_max);
+        float const sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+        float const phi = 2.0f * pi * u2;
+        auto const [tangent, bitangent] = tangent_frame(w);
+        vec3 const direction =
+            sin_theta * std::cos(phi) * tangent + sin_theta * std::sin(phi) * bitangent + cos_theta * w;
+        float const m = dot(to_center, direction);
+        float const g = std::max(0.0f, m * m - distance_squared + radius * radius);
+        return from + (m - std::sqrt(g)) * direction;
+    }
+    vec3 const& get_color() const { return color; }
+    vec3 const& get_position() const { return position; }
+    float get_radius() const { return radius; }
+};
+
+//
+// Acceleration structures
+//
+enum class AcceleratorType { List, Grid, KdTree, Bvh };
+
+struct Accelerator {
+    virtual ~Accelerator() = default;
+    // Closest hit along the ray, shortening ray.t to it and recording it.
+    virtual bool intersect(Ray& ray, Hit& record) const = 0;
+    // Any hit along the ray closer than ray.t.
+    virtual bool occluded(Ray& ray) const = 0;
+};
+
+// Both queries of a structure with a traverse<AnyHit>(ray, record) member that stops at the first hit if AnyHit.
+template <typename Structure> struct Traversal : public Accelerator {
+    bool intersect(Ray& ray, Hit& record) const
+    {
+        return static_cast<Structure const*>(this)->template traverse<false>(ray, record);
+    }
+    bool occluded(Ray& ray) const
+    {
+        Hit record{};
+        return static_cast<Structure const*>(this)->template traverse<true>(ray, record);
+    }
+};
+
+// Uniform grid (Cleary et al. 1983) traversed with 3D-DDA (Amanatides and Woo 1987). Cell references are built by
+// a parallel counting sort: count overlaps per cell, prefix sum into offsets, then scatter object indices.
+class Grid : public Traversal<Grid>
+{
+    friend struct Traversal<Grid>;
+
+    static constexpr float Density = 4.0;
+    static constexpr size_t MaxResolution = 256;
+
+    std::vector<Object*> objects;
+    AABB box;
+    std::array<size_t, 3> resolution;
+    vec3 cell_size;
+    vec3 inverse_cell_size;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> references;
+
+    size_t cell_index(std::array<size_t, 3> const& cell) const
+    {
+        return (cell[2] * resolution[1] + cell[1]) * resolution[0] + cell[0];
+    }
+
+    std::array<size_t, 3> cell_of(vec3 const& point) const
+    {
+        std::array<size_t, 3> cell{};
+        for (size_t axis = 0; axis < 3; axis++) {
+            float const f = (point[axis] - box.min[axis]) * inverse_cell_size[axis];
+            cell[axis] = static_cast<size_t>(std::clamp(f, 0.0f, static_cast<float>(resolution[axis] - 1)));
+        }
+        return cell;
+    }
+
+    template <typename F> void for_each_cell(AABB const& bounds, F const& f) const
+    {
+        auto const lo = cell_of(bounds.min);
+        auto const hi = cell_of(bounds.max);
+        for (size_t z = lo[2]; z <= hi[2]; z++) {
+            for (size_t y = lo[1]; y <= hi[1]; y++) {
+                for (size_t x = lo[0]; x <= hi[0]; x++) {
+                    f(cell_index({x, y, z}));
+                }
+            }
+        }
+    }
+
+    template <bool AnyHit> bool traverse(Ray& ray, Hit& record) const
+    {
+        float t_enter{0.0};
+        float t_exit{ray.t};
+        if (!box.clip(ray, t_enter, t_exit)) {
+            return false;
+        }
+
+        std::array<size_t, 3> cell = cell_of(ray.origin + t_enter * ray.direction);
+        std::array<long, 3> step{};
+        vec3 t_max{};
+        vec3 t_delta{};
+        for (size_t axis = 0; axis < 3; axis++) {
+            if (ray.direction[axis] > 0.0f) {
+                step[axis] = 1;
+                float const boundary = box.min[axis] + (cell[axis] + 1) * cell_size[axis];
+                t_max[axis] = (boundary - ray.origin[axis]) * ray.inverse_direction[axis];
+                t_delta[axis] = cell_size[axis] * ray.inverse_direction[axis];
+            } else if (ray.direction[axis] < 0.0f) {
+                step[axis] = -1;
+                float const boundary = box.min[axis] + cell[axis] * cell_size[axis];
+                t_max[axis] = (boundary - ray.origin[axis]) * ray.inverse_direction[axis];
+                t_delta[axis] = -cell_size[axis] * ray.inverse_direction[axis];
+            } else {
+                t_max[axis] = std::numeric_limits<float>::infinity();
+                t_delta[axis] = std::numeric_limits<float>::infinity();
+            }
+        }
+
+        bool found{false};
+        while (true) {
+            size_t const index = cell_index(cell);
+            for (uint32_t k = offsets[index]; k < offsets[index + 1]; k++) {
+                Object const* object = objects[references[k]];
+                if (object->hit(ray, record)) {
+                    found = true;
+                    if constexpr (AnyHit) {
+                        return true;
+                    }
+                }
+            }
+            size_t const axis = (t_max[0] < t_max[1]) ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+            // hits are only final once the ray has left every cell in front of them
+            if (ray.t <= t_max[axis]) {
+                return found;
+            }
+            if ((step[axis] < 0 && cell[axis] == 0) || (step[axis] > 0 && cell[axis] + 1 == resolution[axis])) {
+                return found;
+            }
+            cell[axis] += step[axis];
+            t_max[axis] += t_delta[axis];
+        }
+    }
+
+public:
+    Grid(std::vector<Object*> const& objects, std::vector<AABB> const& bounds, AABB const& scene_bounds)
+        : objects{objects}, box{scene_bounds}, resolution{}, cell_size{}, inverse_cell_size{}, offsets{},
+          references{}
+    {
+        // pad so flat scenes still have volume and boundary points fall inside
+        vec3 extent = box.max - box.min;
+        float const padding = 1e-3f * std::max({extent[0], extent[1], extent[2], 1.0f});
+        box.min = box.min - vec3{padding, padding, padding};
+        box.max = box.max + vec3{padding, padding, padding};
+        extent = box.max - box.min;
+
+        float const volume = extent[0] * extent[1] * extent[2];
+        float const cells_per_unit = std::cbrt(Density * std::max<size_t>(objects.size(), 1) / volume);
+        for (size_t axis = 0; axis < 3; axis++) {
+            float const cells = std::clamp(extent[axis] * cells_per_unit, 1.0f, static_cast<float>(MaxResolution));
+            resolution[axis] = static_cast<size_t>(cells);
+            cell_size[axis] = extent[axis] / resolution[axis];
+            inverse_cell_size[axis] = 1.0f / cell_size[axis];
+        }
+        size_t const cell_count = resolution[0] * resolution[1] * resolution[2];
+
+        constexpr size_t Chunk = 1024;
+        size_t const chunks = (objects.size() + Chunk - 1) / Chunk;
+        std::vector<std::atomic<uint32_t>> counts(cell_count);
+        parallel_for(chunks, [&](size_t chunk) {
+            for (size_t k = chunk * Chunk; k < std::min(objects.size(), (chunk + 1) * Chunk); k++) {
+                for_each_cell(bounds[k], [&](size_t cell) { counts[cell].fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+
+        offsets.resize(cell_count + 1);
+        for (size_t cell = 0; cell < cell_count; cell++) {
+            offsets[cell + 1] = offsets[cell] + counts[cell].load(std::memory_order_relaxed);
+            counts[cell].store(offsets[cell], std::memory_order_relaxed);
+        }
+
+        references.resize(offsets[cell_count]);
+        parallel_for(chunks, [&](size_t chunk) {
+            for (size_t k = chunk * Chunk; k < std::min(objects.size(), (chunk + 1) * Chunk); k++) {
+                for_each_cell(bounds[k], [&](size_t cell) {
+                    references[counts[cell].fetch_add(1, std::memory_order_relaxed)] = static_cast<uint32_t>(k);
+                });
+            }
+        });
+        // scatter order depends on thread timing, sorting keeps ties between equal hits deterministic
+        parallel_for((cell_count + Chunk - 1) / Chunk, [&](size_t chunk) {
+            for (size_t cell = chunk * Chunk; cell < std::min(cell_count, (chunk + 1) * Chunk); cell++) {
+                std::sort(references.begin() + offsets[cell], references.begin() + offsets[cell + 1]);
+            }
+        });
+    }
+    Grid(const Grid&) = delete;
+    Grid(Grid&&) = delete;
+    Grid& operator=(const Grid&) = delete;
+    Grid& operator=(Grid&&) = delete;
+};
+
+// SAH kd-tree built in O(N log N) (Wald and Havran 2006): the split candidates of every axis are sorted once at the
+// root and each split partitions the sorted list, only objects straddling the plane are clipped and re-sorted.
+// Candidates come from object bounds clipped to the node, exact for the axis-aligned triangles of architecture.
+class KdTree : public Traversal<KdTree>
+{
+    friend struct Traversal<KdTree>;
+
+    static constexpr float TraversalCost = 1.0;
+    static constexpr float IntersectionCost = 1.5;
+    // rewards cutting off empty space, leaves that rays can skip without testing anything
+    static constexpr float EmptyBonus = 0.8;
+    static constexpr size_t StackSize = 64;
+    static constexpr uint32_t Leaf = 3;
+
+    enum EventType : uint8_t { End, Planar, Start };
+
+    struct Event {
+        float position;
+        uint32_t object;
+        uint8_t axis;
+        EventType type;
+
+        bool operator<(Event const& other) const
+        {
+            if (axis != other.axis) {
+                return axis < other.axis;
+            }
+            if (position != other.position) {
+                return position < other.position;
+            }
+            return type < other.type;
+        }
+    };
+
+    struct Split {
+        float cost;
+        float position;
+        uint8_t axis;
+        bool planar_left;
+    };
+
+    enum Side : uint8_t { Both, LeftOnly, RightOnly };
+
+    // Interior nodes keep the below child right after themselves and the index of the above child, leaves a range
+    // of references.
+    struct Node {
+        float split;
+        uint32_t axis;
+        uint32_t index;
+        uint32_t count;
+    };
+
+    std::vector<Object*> objects;
+    AABB box;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> references;
+    std::vector<Side> sides;
+
+    static void push_events(std::vector<Event>& events, AABB const& clipped, uint32_t object)
+    {
+        for (uint8_t axis = 0; axis < 3; axis++) {
+            if (clipped.min[axis] == clipped.max[axis]) {
+                events.push_back({clipped.min[axis], object, axis, Planar});
+            } else {
+                events.push_back({clipped.min[axis], object, axis, Start});
+                events.push_back({clipped.max[axis], object, axis, End});
+            }
+        }
+    }
+
+    Split find_split(std::vector<Event> const& events, AABB const& node_box, size_t count) const
+    {
+        Split best{std::numeric_limits<float>::infinity(), 0.0, 0, false};
+        float const inverse_area = 1.0f / node_box.half_area();
+        auto sah = [&](uint8_t axis, float position, size_t left, size_t right) {
+            AABB below{node_box};
+            AABB above{node_box};
+            below.max[axis] = position;
+            above.min[axis] = position;
+            float const bonus = (left == 0 || right == 0) ? EmptyBonus : 1.0f;
+            return bonus * (TraversalCost + IntersectionCost * inverse_area *
+                                                (below.half_area() * left + above.half_area() * right));
+        };
+
+        size_t i = 0;
+        for (uint8_t axis = 0; axis < 3; axis++) {
+            size_t left{0};
+            size_t right{count};
+            while (i < events.size() && events[i].axis == axis) {
+                float const position = events[i].position;
+                size_t ending{0};
+                size_t planar{0};
+                size_t starting{0};
+                for (; i < events.size() && events[i].axis == axis && events[i].position == position; i++) {
+                    ending += events[i].type == End;
+                    planar += events[i].type == Planar;
+                    starting += events[i].type == Start;
+                }
+                right -= planar + ending;
+                if (position > node_box.min[axis] && position < node_box.max[axis]) {
+                    float const cost_left = sah(axis, position, left + planar, right);
+                    float const cost_right = sah(axis, position, left, right + planar);
+                    float const cost = std::min(cost_left, cost_right);
+                    if (cost < best.cost) {
+                        best = {cost, position, axis, cost_left <= cost_right};
+                    }
+                }
+                left += starting + planar;
+            }
+        }
+        return best;
+    }
+
+    void build(
+        std::vector<AABB> const& bounds,
+        std::vector<Event>& events,
+        std::vector<uint32_t> const& node_objects,
+        AABB const& node_box,
+        size_t depth
+    )
+    {
+        size_t const node = nodes.size();
+        nodes.push_back({});
+        Split const split = find_split(events, node_box, node_objects.size());
+        if (depth == 0 || split.cost >= IntersectionCost * node_objects.size()) {
+            nodes[node] = {0.0, Leaf, static_cast<uint32_t>(references.size()),
+                           static_cast<uint32_t>(node_objects.size())};
+            references.insert(references.end(), node_objects.begin(), node_objects.end());
+            return;
+        }
+
+        for (auto const object : node_objects) {
+            sides[object] = Both;
+        }
+        for (auto const& event : events) {
+            if (event.axis != split.axis) {
+                continue;
+            }
+            if (event.type == End && event.position <= split.position) {
+                sides[event.object] = LeftOnly;
+            } else if (event.type == Start && event.position >= split.position) {
+                sides[event.object] = RightOnly;
+            } else if (event.type == Planar) {
+                bool const left = event.position < split.position ||
+                                  (event.position == split.position && split.planar_left);
+                sides[event.object] = left ? LeftOnly : RightOnly;
+            }
+        }
+
+        AABB below{node_box};
+        AABB above{node_box};
+        below.max[split.axis] = split.position;
+        above.min[split.axis] = split.position;
+
+        std::vector<Event> left_events;
+        std::vector<Event> right_events;
+        for (auto const& event : events) {
+            if (sides[event.object] == LeftOnly) {
+                left_events.push_back(event);
+            } else if (sides[event.object] == RightOnly) {
+                right_events.push_back(event);
+            }
+        }
+        std::vector<uint32_t> left_objects;
+        std::vector<uint32_t> right_objects;
+        std::vector<Event> left_straddling;
+        std::vector<Event> right_straddling;
+        for (auto const object : node_objects) {
+            if (sides[object] != RightOnly) {
+                left_objects.push_back(object);
+            }
+            if (sides[object] != LeftOnly) {
+                right_objects.push_back(object);
+            }
+            if (sides[object] == Both) {
+                push_events(left_straddling, bounds[object].intersection(below), object);
+                push_events(right_straddling, bounds[object].intersection(above), object);
+            }
+        }
+        events.clear();
+        events.shrink_to_fit();
+
+        // only the straddling objects need sorting, then a linear merge keeps the lists ordered
+        auto merge = [](std::vector<Event>& sorted, std::vector<Event>& straddling) {
+            std::sort(straddling.begin(), straddling.end());
+            size_t const middle = sorted.size();
+            sorted.insert(sorted.end(), straddling.begin(), straddling.end());
+            std::inplace_merge(sorted.begin(), sorted.begin() + middle, sorted.end());
+        };
+        merge(left_events, left_straddling);
+        merge(right_events, right_straddling);
+
+        build(bounds, left_events, left_objects, below, depth - 1);
+        uint32_t const above_index = static_cast<uint32_t>(nodes.size());
+        build(bounds, right_events, right_objects, above, depth - 1);
+        nodes[node] = {split.position, split.axis, above_index, 0};
+    }
+
+    template <bool AnyHit> bool traverse(Ray& ray, Hit& record) const
+    {
+        struct Entry {
+            uint32_t node;
+            float near;
+            float far;
+        };
+
+        float near{0.0};
+        float far{ray.t};
+        if (!box.clip(ray, near, far)) {
+            return false;
+        }
+
+        std::array<Entry, StackSize> stack;
+        size_t stack_size{0};
+        uint32_t node{0};
+        bool found{false};
+        while (true) {
+            Node const& current = nodes[node];
+            if (current.axis != Leaf) {
+                float const origin = ray.origin[current.axis];
+                float const t_split = (current.split - origin) * ray.inverse_direction[current.axis];
+                bool const below_first = origin < current.split || (origin == current.split &&
+                                                                    ray.direction[current.axis] <= 0.0f);
+                uint32_t const first = below_first ? node + 1 : current.index;
+                uint32_t const second = below_first ? current.index : node + 1;
+                if (std::isnan(t_split)) {
+                    // the ray lies in the split plane and can touch objects on either side along its whole length
+                    stack[stack_size++] = {second, near, far};
+                    node = first;
+                } else if (t_split > far || t_split <= 0.0f) {
+                    node = first;
+                } else if (t_split < near) {
+                    node = second;
+                } else {
+                    stack[stack_size++] = {second, t_split, far};
+                    node = first;
+                    far = t_split;
+                }
+                continue;
+            }
+
+            for (uint32_t k = current.index; k < current.index + current.count; k++) {
+                Object const* object = objects[references[k]];
+                if (object->hit(ray, record)) {
+                    found = true;
+                    if constexpr (AnyHit) {
+                        return true;
+                    }
+                }
+            }
+            // leaves are visited front to back, a hit inside this one beats everything behind it
+            if (ray.t <= far || stack_size == 0) {
+                return found;
+            }
+            Entry const& entry = stack[--stack_size];
+            node = entry.node;
+            near = entry.near;
+            far = entry.far;
+        }
+    }
+
+public:
+    KdTree(std::vector<Object*> const& objects, std::vector<AABB> const& bounds, AABB const& scene_bounds)
+        : objects{objects}, box{scene_bounds}, nodes{}, references{}, sides(objects.size())
+    {
+        std::vector<Event> events;
+        std::vector<uint32_t> all(objects.size());
+        for (uint32_t object = 0; object < objects.size(); object++) {
+            push_events(events, bounds[object], object);
+            all[object] = object;
+        }
+        std::sort(events.begin(), events.end());
+        // depth bound of Havran's thesis, kept below the traversal stack size
+        size_t const depth = std::min<size_t>(
+            StackSize - 1, static_cast<size_t>(8.0f + 1.3f * std::log2(std::max<size_t>(objects.size(), 1))));
+        build(bounds, events, all, box, depth);
+        sides.clear();
+        sides.shrink_to_fit();
+    }
+    KdTree(const KdTree&) = delete;
+    KdTree(KdTree&&) = delete;
+    KdTree& operator=(const KdTree&) = delete;
+    KdTree& operator=(KdTree&&) = delete;
+};
+
+// Interior nodes keep the left child right after themselves and the index of the right child, leaves a range of
+// references.
+struct BvhNode {
+    AABB box;
+    uint32_t index;
+    uint32_t count;
+
+    AABB const& box_at(float) const { return box; }
+};
+
+// Node bounds at shutter open and close.
+struct MotionBvhNode {
+    std::array<AABB, 2> boxes;
+    uint32_t index;
+    uint32_t count;
+
+    AABB box_at(float time) const { return AABB::interpolate(boxes[0], boxes[1], time); }
+};
+
+// Storage, cost model and front to back traversal shared by the binned SAH hierarchies. They differ in how a node
+// is built and in the box its box_at returns for the ray time.
+template <typename Node> class BvhBase : public Traversal<BvhBase<Node>>
+{
+    friend struct Traversal<BvhBase<Node>>;
+
+protected:
+    static constexpr float TraversalCost = 1.0;
+    static constexpr float IntersectionCost = 1.5;
+    static constexpr size_t Bins = 32;
+    static constexpr size_t MaxLeafSize = 8;
+    static constexpr size_t StackSize = 64;
+
+    std::vector<Object*> objects;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> references;
+
+    explicit BvhBase(std::vector<Object*> const& objects) : objects{objects}, nodes{}, references{} {}
+
+    static float area(AABB const& box) { return box.empty() ? 0.0f : box.half_area(); }
+
+    template <bool AnyHit> bool traverse(Ray& ray, Hit& record) const
+    {
+        struct Entry {
+            uint32_t node;
+            float near;
+        };
+
+        auto const clip = [&](uint32_t node, float& near) {
+            float far{ray.t};
+            near = 0.0;
+            return nodes[node].box_at(ray.time).clip(ray, near, far);
+        };
+        float root_near{};
+        if (nodes.empty() || !clip(0, root_near)) {
+            return false;
+        }
+
+        std::array<Entry, StackSize> stack;
+        size_t stack_size{0};
+        stack[stack_size++] = {0, root_near};
+        bool found{false};
+        while (stack_size > 0) {
+            Entry const entry = stack[--stack_size];
+            // the ray may have been shortened past this node since it was pushed
+            if (entry.near > ray.t) {
+                continue;
+            }
+            Node const& current = nodes[entry.node];
+            if (current.count > 0) {
+                for (uint32_t k = current.index; k < current.index + current.count; k++) {
+                    Object const* object = objects[references[k]];
+                    if (object->hit(ray, record)) {
+                        found = true;
+                        if constexpr (AnyHit) {
+                            return true;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            std::array<uint32_t, 2> const children{entry.node + 1, current.index};
+            std::array<float, 2> near{};
+            std::array<bool, 2> const hit{clip(children[0], near[0]), clip(children[1], near[1])};
+            // the nearer child is popped first
+            size_t const first = (hit[0] && hit[1]) ? (near[1] < near[0]) : !hit[0];
+            if (hit[1 - first]) {
+                stack[stack_size++] = {children[1 - first], near[1 - first]};
+            }
+            if (hit[first]) {
+                stack[stack_size++] = {children[first], near[first]};
+            }
+        }
+        return found;
+    }
+};
+
+// Spatial split BVH (Stich et al. 2009). Every node weighs the best binned object split against the best binned
+// spatial split, which clips the references straddling a plane into both children instead of letting one child
+// grow over them. Spatial splits are only tried where the object split children overlap noticeably, and stop once
+// the duplicated references would exceed MaxGrowth times the object count.
+class Bvh : public BvhBase<BvhNode>
+{
+    // overlap relative to the root area above which spatial splits are considered
+    static constexpr float Alpha = 1e-5;
+    static constexpr float MaxGrowth = 1.0;
+
+    struct Reference {
+        AABB box;
+        uint32_t object;
+    };
+
+    struct Split {
+        float cost;
+        uint8_t axis;
+        // object splits cut between centroid bins, spatial splits at the plane position
+        size_t bin;
+        float position;
+        bool spatial;
+        AABB left;
+        AABB right;
+        size_t left_count;
+        size_t right_count;
+    };
+
+    float root_area;
+    size_t duplicate_budget;
+
+    static size_t centroid_bin(Reference const& reference, AABB const& centroids, uint8_t axis)
+    {
+        float const extent = centroids.max[axis] - centroids.min[axis];
+        float const centroid = 0.5f * (reference.box.min[axis] + reference.box.max[axis]);
+        float const f = (centroid - centroids.min[axis]) * (Bins / extent);
+        return std::min(Bins - 1, static_cast<size_t>(std::max(0.0f, f)));
+    }
+
+    Split find_object_split(std::vector<Reference> const& node_references, AABB const& centroids) const
+    {
+        Split best{};
+        best.cost = std::numeric_limits<float>::infinity();
+        for (uint8_t axis = 0; axis < 3; axis++) {
+            if (!(centroids.max[axis] > centroids.min[axis])) {
+                continue;
+            }
+            std::array<AABB, Bins> boxes{};
+            std::array<size_t, Bins> counts{};
+            for (auto const& reference : node_references) {
+                size_t const bin = centroid_bin(reference, centroids, axis);
+                boxes[bin].extend(reference.box);
+                counts[bin]++;
+            }
+            std::array<AABB, Bins> right_boxes{};
+            AABB right{};
+            for (size_t bin = Bins - 1; bin > 0; bin--) {
+                right.extend(boxes[bin]);
+                right_boxes[bin] = right;
+            }
+            AABB left{};
+            size_t left_count{0};
+            for (size_t bin = 0; bin + 1 < Bins; bin++) {
+                left.extend(boxes[bin]);
+                left_count += counts[bin];
+                size_t const right_count = node_references.size() - left_count;
+                if (left_count == 0 || right_count == 0) {
+                    continue;
+                }
+                float const cost = area(left) * left_count + area(right_boxes[bin + 1]) * right_count;
+                if (cost < best.cost) {
+                    best = {cost, axis, bin, 0.0, false, left, right_boxes[bin + 1], left_count, right_count};
+                }
+            }
+        }
+        return best;
+    }
+
+    Split find_spatial_split(std::vector<Reference> const& node_references, AABB const& node_box) const
+    {
+        Split best{};
+        best.cost = std::numeric_limits<float>::infinity();
+        for (uint8_t axis = 0; axis < 3; axis++) {
+            float const low = node_box.min[axis];
+            float const width = (node_box.max[axis] - low) / Bins;
+            if (!(width > 0.0f)) {
+                continue;
+            }
+            auto const bin_of = [&](float x) {
+                return std::min(Bins - 1, static_cast<size_t>(std::max(0.0f, (x - low) / width)));
+            };
+            std::array<AABB, Bins> boxes{};
+            std::array<size_t, Bins> entries{};
+            std::array<size_t, Bins> exits{};
+            for (auto const& reference : node_references) {
+                size_t const first = bin_of(reference.box.min[axis]);
+                size_t const last = bin_of(reference.box.max[axis]);
+                AABB remainder = reference.box;
+                for (size_t bin = first; bin < last && !remainder.empty(); bin++) {
+                    float const position = low + (bin + 1) * width;
+                    auto const [part, rest] = objects[reference.object]->split_bounds(remainder, axis, position);
+                    if (!part.empty()) {
+                        boxes[bin].extend(part);
+                    }
+                    remainder = rest;
+                }
+                if (!remainder.empty()) {
+                    boxes[last].extend(remainder);
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+            std::array<AABB, Bins> right_boxes{};
+            std::array<size_t, Bins> right_counts{};
+            AABB right{};
+            size_t right_count{0};
+            for (size_t bin = Bins - 1; bin > 0; bin--) {
+                right.extend(boxes[bin]);
+                right_count += exits[bin];
+                right_boxes[bin] = right;
+                right_counts[bin] = right_count;
+            }
+            AABB left{};
+            size_t left_count{0};
+            for (size_t bin = 0; bin + 1 < Bins; bin++) {
+                left.extend(boxes[bin]);
+                left_count += entries[bin];
+                if (left_count == 0 || right_counts[bin + 1] == 0) {
+                    continue;
+                }
+                float const cost = area(left) * left_count + area(right_boxes[bin + 1]) * right_counts[bin + 1];
+                if (cost < best.cost) {
+                    best = {cost, axis, bin, low + (bin + 1) * width, true, left, right_boxes[bin + 1],
+                            left_count, right_counts[bin + 1]};
+                }
+            }
+        }
+        return best;
+    }
+
+    void partition_object(
+        std::vector<Reference> const& node_references,
+        AABB const& centroids,
+        Split const& split,
+        std::vector<Reference>& left,
+        std::vector<Reference>& right
+    ) const
+    {
+        for (auto const& reference : node_references) {
+            (centroid_bin(reference, centroids, split.axis) <= split.bin ? left : right).push_back(reference);
+        }
+    }
+
+    // Straddling references are split unless keeping them whole on one side is cheaper (reference unsplitting).
+    void partition_spatial(
+        std::vector<Reference> const& node_references,
+        Split const& split,
+        std::vector<Reference>& left,
+        std::vector<Reference>& right
+    )
+    {
+        AABB left_box = split.left;
+        AABB right_box = split.right;
+        size_t left_count = split.left_count;
+        size_t right_count = split.right_count;
+        for (auto const& reference : node_references) {
+            if (reference.box.max[split.axis] <= split.position) {
+                left.push_back(reference);
+                continue;
+            }
+            if (reference.box.min[split.axis] >= split.position) {
+                right.push_back(reference);
+                continue;
+            }
+            AABB left_union = left_box;
+            left_union.extend(reference.box);
+            AABB right_union = right_box;
+            right_union.extend(reference.box);
+            float const split_cost = area(left_box) * left_count + area(right_box) * right_count;
+            float const left_cost = area(left_union) * left_count + area(right_box) * (right_count - 1);
+            float const right_cost = area(left_box) * (left_count - 1) + area(right_union) * right_count;
+            if (left_cost < split_cost && left_cost <= right_cost) {
+                left.push_back(reference);
+                left_box = left_union;
+                right_count--;
+            } else if (right_cost < split_cost) {
+                right.push_back(reference);
+                right_box = right_union;
+                left_count--;
+            } else {
+                Object const* object = objects[reference.object];
+                auto const [below, above] = object->split_bounds(reference.box, split.axis, split.position);
+                if (!below.empty() && !above.empty()) {
+                    left.push_back({below, reference.object});
+                    right.push_back({above, reference.object});
+                    duplicate_budget--;
+                } else {
+                    (below.empty() ? right : left).push_back(reference);
+                }
+            }
+        }
+    }
+
+    void build(std::vector<Reference>& node_references, AABB const& node_box, size_t depth)
+    {
+        size_t const node = nodes.size();
+        nodes.push_back({node_box, static_cast<uint32_t>(references.size()),
+                         static_cast<uint32_t>(node_references.size())});
+        auto const make_leaf = [&]() {
+            for (auto const& reference : node_references) {
+                references.push_back(reference.object);
+            }
+        };
+        if (node_references.size() <= 1 || depth == 0) {
+            make_leaf();
+            return;
+        }
+
+        AABB centroids{};
+        for (auto const& reference : node_references) {
+            centroids.extend(0.5f * (reference.box.min + reference.box.max));
+        }
+        Split best = find_object_split(node_references, centroids);
+        AABB const overlap = best.left.intersection(best.right);
+        if (area(overlap) > Alpha * root_area) {
+            Split const spatial = find_spatial_split(node_references, node_box);
+            size_t const duplicates = spatial.left_count + spatial.right_count - node_references.size();
+            if (spatial.cost < best.cost && duplicates <= duplicate_budget) {
+                best = spatial;
+            }
+        }
+
+        float const leaf_cost = IntersectionCost * node_references.size();
+        float const split_cost = TraversalCost + IntersectionCost * best.cost / area(node_box);
+        if (best.cost == std::numeric_limits<float>::infinity() ||
+            (split_cost >= leaf_cost && node_references.size() <= MaxLeafSize)) {
+            make_leaf();
+            return;
+        }
+
+        std::vector<Reference> left{};
+        std::vector<Reference> right{};
+        if (best.spatial) {
+            partition_spatial(node_references, best, left, right);
+        } else {
+            partition_object(node_references, centroids, best, left, right);
+        }
+        if (left.empty() || right.empty()) {
+            make_leaf();
+            return;
+        }
+        node_references.clear();
+        node_references.shrink_to_fit();
+
+        AABB left_box{};
+        for (auto const& reference : left) {
+            left_box.extend(reference.box);
+        }
+        AABB right_box{};
+        for (auto const& reference : right) {
+            right_box.extend(reference.box);
+        }
+        build(left, left_box, depth - 1);
+        uint32_t const right_index = static_cast<uint32_t>(nodes.size());
+        build(right, right_box, depth - 1);
+        nodes[node].index = right_index;
+        nodes[node].count = 0;
+    }
+
+public:
+    Bvh(std::vector<Object*> const& objects, std::vector<AABB> const& bounds, AABB const& scene_bounds)
+        : BvhBase(objects), root_area{area(scene_bounds)},
+          duplicate_budget{static_cast<size_t>(MaxGrowth * objects.size())}
+    {
+        std::vector<Reference> all(objects.size());
+        for (uint32_t object = 0; object < objects.size(); object++) {
+            all[object] = {bounds[object], object};
+        }
+        build(all, scene_bounds, StackSize - 2);
+    }
+    Bvh(const Bvh&) = delete;
+    Bvh(Bvh&&) = delete;
+    Bvh& operator=(const Bvh&) = delete;
+    Bvh& operator=(Bvh&&) = delete;
+};
+
+// BVH for scenes with moving objects. Every node keeps its bounds at shutter open and close and traversal tests the
+// box interpolated to the ray time, which stays tight for linear motion where bounds swept over the shutter would
+// not. The topology comes from binned SAH object splits of the bounds at mid-shutter, so objects moving together
+// stay together; spatial splits are left out as clipped references would not move with their object.
+class MotionBvh : public BvhBase<MotionBvhNode>
+{
+    std::vector<std::array<AABB, 2>> object_boxes;
+    std::vector<AABB> middle_boxes;
+
+    void build(std::vector<uint32_t>& node_objects, size_t depth)
+    {
+        size_t const node = nodes.size();
+        std::array<AABB, 2> boxes{};
+        AABB middle{};
+        AABB centroids{};
+        for (auto const object : node_objects) {
+            boxes[0].extend(object_boxes[object][0]);
+            boxes[1].extend(object_boxes[object][1]);
+            middle.extend(middle_boxes[object]);
+            centroids.extend(0.5f * (middle_boxes[object].min + middle_boxes[object].max));
+        }
+        nodes.push_back({boxes, static_cast<uint32_t>(references.size()), static_cast<uint32_t>(node_objects.size())});
+        auto const make_leaf = [&]() { references.insert(references.end(), node_objects.begin(), node_objects.end()); };
+        if (node_objects.size() <= 1 || depth == 0) {
+            make_leaf();
+            return;
+        }
+
+        auto const bin_of = [&](uint32_t object, size_t axis) {
+            float const centroid = 0.5f * (middle_boxes[object].min[axis] + middle_boxes[object].max[axis]);
+            float const f = (centroid - centroids.min[axis]) * (Bins / (centroids.max[axis] - centroids.min[axis]));
+            return std::min(Bins - 1, static_cast<size_t>(std::max(0.0f, f)));
+        };
+        float best_cost{std::numeric_limits<float>::infinity()};
+        size_t best_axis{0};
+        size_t best_bin{0};
+        for (size_t axis = 0; axis < 3; axis++) {
+            if (!(centroids.max[axis] > centroids.min[axis])) {
+                continue;
+            }
+            std::array<AABB, Bins> bin_boxes{};
+            std::array<size_t, Bins> counts{};
+            for (auto const object : node_objects) {
+                size_t const bin = bin_of(object, axis);
+                bin_boxes[bin].extend(middle_boxes[object]);
+                counts[bin]++;
+            }
+            std::array<float, Bins> right_costs{};
+            AABB right{};
+            size_t right_count{0};
+            for (size_t bin = Bins - 1; bin > 0; bin--) {
+                right.extend(bin_boxes[bin]);
+                right_count += counts[bin];
+                right_costs[bin] = area(right) * right_count;
+            }
+            AABB left{};
+            size_t left_count{0};
+            for (size_t bin = 0; bin + 1 < Bins; bin++) {
+                left.extend(bin_boxes[bin]);
+                left_count += counts[bin];
+                if (left_count == 0 || left_count == node_objects.size()) {
+                    continue;
+                }
+                float const cost = area(left) * left_count + right_costs[bin + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = bin;
+                }
+            }
+        }
+
+        float const leaf_cost = IntersectionCost * node_objects.size();
+        float const split_cost = TraversalCost + IntersectionCost * best_cost / area(middle);
+        if (best_cost == std::numeric_limits<float>::infinity() ||
+            (split_cost >= leaf_cost && node_objects.size() <= MaxLeafSize)) {
+            make_leaf();
+            return;
+        }
+
+        std::vector<uint32_t> left{};
+        std::vector<uint32_t> right{};
+        for (auto const object : node_objects) {
+            (bin_of(object, best_axis) <= best_bin ? left : right).push_back(object);
+        }
+        node_objects.clear();
+        node_objects.shrink_to_fit();
+        build(left, depth - 1);
+        uint32_t const right_index = static_cast<uint32_t>(nodes.size());
+        build(right, depth - 1);
+        nodes[node].index = right_index;
+        nodes[node].count = 0;
+    }
+
+public:
+    explicit MotionBvh(std::vector<Object*> const& objects)
+        : BvhBase(objects), object_boxes(objects.size()), middle_boxes(objects.size())
+    {
+        std::vector<uint32_t> all(objects.size());
+        for (uint32_t object = 0; object < objects.size(); object++) {
+            object_boxes[object] = {objects[object]->bounds_at(0.0), objects[object]->bounds_at(1.0)};
+            middle_boxes[object] = AABB::interpolate(object_boxes[object][0], object_boxes[object][1], 0.5);
+            all[object] = object;
+        }
+        if (!all.empty()) {
+            build(all, StackSize - 2);
+        }
+        object_boxes.clear();
+        object_boxes.shrink_to_fit();
+        middle_boxes.clear();
+        middle_boxes.shrink_to_fit();
+    }
+    MotionBvh(const MotionBvh&) = delete;
+    MotionBvh(MotionBvh&&) = delete;
+    MotionBvh& operator=(const MotionBvh&) = delete;
+    MotionBvh& operator=(MotionBvh&&) = delete;
+};
+
+//
+// Meshes
+//
+// Indexed meshes share one position array among their faces. Triangles stay triangles and quads are kept whole,
+// intersected as the triangle pair around their first diagonal in one combined test rather than as two separate
+// triangles. The scene holds a MeshTriangle or MeshQuad view per face, the index of its corners, so the
+// acceleration structures see ordinary objects.
+//
+struct Mesh {
+    std::vector<vec3> positions;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    // v0 v1 v2 v3, covering the same surface as the triangles (v0, v1, v2) and (v0, v2, v3)
+    std::vector<std::array<uint32_t, 4>> quads;
+    Material material;
+
+    AABB bounds() const
+    {
+        AABB box{};
+        for (auto const& position : positions) {
+            box.extend(position);
+        }
+        return box;
+    }
+
+    template <size_t N> std::array<vec3, N> face(std::array<uint32_t, N> const& corners) const
+    {
+        std::array<vec3, N> result{};
+        for (size_t corner = 0; corner < N; corner++) {
+            result[corner] = positions[corners[corner]];
+        }
+        return result;
+    }
+    std::array<vec3, 3> triangle(uint32_t index) const { return face(triangles[index]); }
+    std::array<vec3, 4> quad(uint32_t index) const { return face(quads[index]); }
+
+    size_t triangle_count() const { return triangles.size(); }
+    size_t quad_count() const { return quads.size(); }
+    size_t memory() const
+    {
+        return positions.size() * sizeof(vec3) + triangles.size() * sizeof(triangles[0]) +
+               quads.size() * sizeof(quads[0]);
+    }
+};
+
+// Mesh at about half the footprint of Mesh. Triangles and quads are grouped in order into clusters of ClusterSize
+// faces, each with its own copy of the vertices it uses, so corners are 8 bit indices relative to the cluster's
+// first vertex. Positions are points of a lattice spanning the mesh, stored as 16 bit offsets from the cluster's
+// lattice origin. The lattice is fine enough for the largest cluster to span 65535 steps and coarse enough for mesh
+// wide coordinates to stay exact in a float, vertices shared by clusters decode to the very same point so the
+// surface stays watertight. Faces are decoded on every use.
+class QuantizedMesh
+{
+    // 64 quads use at most 256 vertices, the most an 8 bit corner can address
+    static constexpr size_t ClusterSize = 64;
+    static constexpr double MaximumLattice = (1 << 24) - 1;
+
+    struct Cluster {
+        std::array<uint32_t, 3> origin;
+        uint32_t first_vertex;
+    };
+
+    template <size_t N> struct Faces {
+        std::vector<Cluster> clusters;
+        std::vector<std::array<uint8_t, N>> corners;
+    };
+
+    vec3 origin;
+    vec3 step;
+    std::vector<std::array<uint16_t, 3>> positions;
+    Faces<3> triangles;
+    Faces<4> quads;
+
+    // Extent along every axis of the largest cluster of faces.
+    template <size_t N>
+    static vec3 largest_cluster(Mesh const& mesh, std::vector<std::array<uint32_t, N>> const& faces)
+    {
+        vec3 largest{};
+        for (size_t begin = 0; begin < faces.size(); begin += ClusterSize) {
+            AABB cluster_box{};
+            for (size_t k = begin; k < std::min(faces.size(), begin + ClusterSize); k++) {
+                for (auto const& position : mesh.face(faces[k])) {
+                    cluster_box.extend(position);
+                }
+            }
+            for (size_t axis = 0; axis < 3; axis++) {
+                largest[axis] = std::max(largest[axis], cluster_box.max[axis] - cluster_box.min[axis]);
+            }
+        }
+        return largest;
+    }
+
+    std::array<uint32_t, 3> lattice(vec3 const& position) const
+    {
+        std::array<uint32_t, 3> point{};
+        for (size_t axis = 0; axis < 3; axis++) {
+            point[axis] = static_cast<uint32_t>(std::lround((position[axis] - origin[axis]) / step[axis]));
+        }
+        return point;
+    }
+
+    // local holds a slot per mesh vertex for its index within the cluster being built.
+    template <size_t N>
+    void quantize(
+        Mesh const& mesh,
+        std::vector<std::array<uint32_t, N>> const& faces,
+        Faces<N>& result,
+        std::vector<uint8_t>& local
+    )
+    {
+        result.clusters.reserve((faces.size() + ClusterSize - 1) / ClusterSize);
+        result.corners.reserve(faces.size());
+        std::vector<uint32_t> used{};
+        for (size_t begin = 0; begin < faces.size(); begin += ClusterSize) {
+            size_t const end = std::min(faces.size(), begin + ClusterSize);
+            used.clear();
+            for (size_t k = begin; k < end; k++) {
+                used.insert(used.end(), faces[k].begin(), faces[k].end());
+            }
+            std::sort(used.begin(), used.end());
+            used.erase(std::unique(used.begin(), used.end()), used.end());
+            Cluster cluster{{UINT32_MAX, UINT32_MAX, UINT32_MAX}, static_cast<uint32_t>(positions.size())};
+            for (uint32_t vertex : used) {
+                auto const point = lattice(mesh.positions[vertex]);
+                for (size_t axis = 0; axis < 3; axis++) {
+                    cluster.origin[axis] = std::min(cluster.origin[axis], point[axis]);
+                }
+            }
+            for (size_t v = 0; v < used.size(); v++) {
+                auto const point = lattice(mesh.positions[used[v]]);
+                positions.push_back({static_cast<uint16_t>(point[0] - cluster.origin[0]),
+                                     static_cast<uint16_t>(point[1] - cluster.origin[1]),
+                                     static_cast<uint16_t>(point[2] - cluster.origin[2])});
+                local[used[v]] = static_cast<uint8_t>(v);
+            }
+            for (size_t k = begin; k < end; k++) {
+                std::array<uint8_t, N> corners{};
+                for (size_t corner = 0; corner < N; corner++) {
+                    corners[corner] = local[faces[k][corner]];
+                }
+                result.corners.push_back(corners);
+            }
+            result.clusters.push_back(cluster);
+        }
+    }
+
+    template <size_t N> std::array<vec3, N> decode(Faces<N> const& faces, uint32_t index) const
+    {
+        Cluster const& cluster = faces.clusters[index / ClusterSize];
+        std::array<vec3, N> result{};
+        for (size_t corner = 0; corner < N; corner++) {
+            auto const& offset = positions[cluster.first_vertex + faces.corners[index][corner]];
+            for (size_t axis = 0; axis < 3; axis++) {
+                float const lattice = static_cast<float>(cluster.origin[axis] + offset[axis]);
+                result[corner][axis] = origin[axis] + lattice * step[axis];
+            }
+        }
+        return result;
+    }
+
+public:
+    Material material;
+
+    explicit QuantizedMesh(Mesh const& mesh)
+        : origin{}, step{}, positions{}, triangles{}, quads{}, material{mesh.material}
+    {
+        AABB const box = mesh.bounds();
+        origin = box.min;
+        vec3 const largest_triangles = largest_cluster(mesh, mesh.triangles);
+        vec3 const largest_quads = largest_cluster(mesh, mesh.quads);
+        for (size_t axis = 0; axis < 3; axis++) {
+            double const largest = std::max(largest_triangles[axis], largest_quads[axis]);
+            double const extent = static_cast<double>(box.max[axis]) - box.min[axis];
+            double const lattice_step = std::max(largest / 65535.0, extent / MaximumLattice);
+            step[axis] = lattice_step > 0.0 ? static_cast<float>(lattice_step) : 1.0f;
+        }
+        std::vector<uint8_t> local(mesh.positions.size(), 0);
+        quantize(mesh, mesh.triangles, triangles, local);
+        quantize(mesh, mesh.quads, quads, local);
+    }
+
+    std::array<vec3, 3> triangle(uint32_t index) const { return decode(triangles, index); }
+    std::array<vec3, 4> quad(uint32_t index) const { return decode(quads, index); }
+
+    size_t triangle_count() const { return triangles.corners.size(); }
+    size_t quad_count() const { return quads.corners.size(); }
+    size_t memory() const
+    {
+        return (triangles.clusters.size() + quads.clusters.size()) * sizeof(Cluster) +
+               positions.size() * sizeof(positions[0]) + triangles.corners.size() * sizeof(triangles.corners[0]) +
+               quads.corners.size() * sizeof(quads.corners[0]);
+    }
+    // Largest distance along an axis between a vertex and its stored lattice point.
+    float max_error() const { return 0.5f * std::max({step[0], step[1], step[2]}); }
+};
+
+template <typename M> class MeshTriangle : public Object
+{
+    M const* mesh;
+    uint32_t index;
+
+public:
+    MeshTriangle(M const* mesh, uint32_t index) : mesh(mesh), index(index) {}
+
+    std::array<vec3, 3> positions() const { return mesh->triangle(index); }
+
+    bool hit(Ray& ray, Hit& record) const
+    {
+        if (!hit_triangle(positions(), ray, record)) {
+            return false;
+        }
+        record.primitive = index;
+        return record.on(this, mesh->material);
+    }
+
+    Material const& material() const { return mesh->material; }
+    AABB bounds() const
+    {
+        AABB box{};
+        for (auto const& position : positions()) {
+            box.extend(position);
+        }
+        return box;
+    }
+
+    std::array<AABB, 2> split_bounds(AABB const& box, size_t axis, float position) const
+    {
+        return split_polygon_bounds(positions(), box, axis, position);
+    }
+};
+
+// Mesh quad v0 v1 v2 v3 intersected like Quad, as the triangle pair (v0, v2, v1) and (v0, v2, v3). Its primitives
+// are twice the quad index for the first triangle and one more for the second.
+template <typename M> class MeshQuad : public Object
+{
+    M const* mesh;
+    uint32_t index;
+
+    std::array<vec3, 3> triangle(size_t k) const
+    {
+        auto const corners = positions();
+        return {corners[0], corners[2], corners[k == 0 ? 1 : 3]};
+    }
+
+public:
+    MeshQuad(M const* mesh, uint32_t index) : mesh(mesh), index(index) {}
+
+    std::array<vec3, 4> positions() const { return mesh->quad(index); }
+
+    bool hit(Ray& ray, Hit& record) const
+    {
+        auto const corners = positions();
+        vec3 const diagonal = corners[2] - corners[0];
+        std::array<vec3, 2> const edges{corners[1] - corners[0], corners[3] - corners[0]};
+        if (!hit_triangle_pair(corners[0], diagonal, edges, ray, record)) {
+            return false;
+        }
+        size_t const k = record.primitive;
+        record.normal = triangle_pair_normal(diagonal, edges, k);
+        record.primitive = static_cast<uint32_t>(2 * index + k);
+        return record.on(this, mesh->material);
+    }
+
+    Material const& material() const { return mesh->material; }
+    AABB bounds() const
+    {
+        AABB box{};
+        for (auto const& position : positions()) {
+            box.extend(position);
+        }
+        return box;
+    }
+
+    std::array<AABB, 2> split_bounds(AABB const& box, size_t axis, float position) const
+    {
+        std::array<AABB, 2> parts = split_polygon_bounds(triangle(0), box, axis, position);
+        std::array<AABB, 2> const second = split_polygon_bounds(triangle(1), box, axis, position);
+        parts[0].extend(second[0]);
+        parts[1].extend(second[1]);
+        return parts;
+    }
+};
+
+// A mesh together with the views into it, which must not move once the scene points at them.
+template <typename M> struct MeshStorage {
+    M mesh;
+    std::vector<MeshTriangle<M>> triangles;
+    std::vector<MeshQuad<M>> quads;
+
+    explicit MeshStorage(M&& mesh) : mesh{std::move(mesh)}, triangles{}, quads{} {}
+};
+
+//
+// Binary scenes
+//
+// A scene file is a SceneFileHeader followed by packed arrays of fixed size records, each section starting on a
+// SceneFileAlignment boundary and described by its offset and record count. Loading maps the file read only and
+// the spheres and triangles of the scene are thin views that intersect straight from the mapped records, so
+// geometry is neither parsed nor copied. Materials are stored as Material values and indexed by the primitives,
+// the handful of lights and planes are copied into the scene. All fields are in host byte order.
+//
+static_assert(std::is_trivially_copyable_v<Material> && std::is_standard_layout_v<Material>);
+
+constexpr size_t SceneFileAlignment = 64;
+constexpr uint32_t SceneFileVersion = 1;
+
+struct SceneFileSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct SceneFileHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t reserved;
+    SceneFileSection materials;
+    SceneFileSection lights;
+    SceneFileSection sphere_lights;
+    SceneFileSection planes;
+    SceneFileSection spheres;
+    SceneFileSection triangles;
+};
+
+struct LightRecord {
+    vec3 position;
+    vec3 color;
+};
+
+struct SphereLightRecord {
+    vec3 position;
+    float radius;
+    vec3 color;
+};
+
+struct PlaneRecord {
+    vec3 normal;
+    float offset;
+    uint32_t material;
+};
+
+struct SphereRecord {
+    vec3 position;
+    float radius;
+    uint32_t material;
+};
+
+struct TriangleRecord {
+    std::array<vec3, 3> positions;
+    uint32_t material;
+};
+
+// Read only mapping of a whole file, unmapped on destruction.
+class MappedFile
+{
+    void* mapping;
+    size_t size;
+
+public:
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    explicit MappedFile(std::string const& path) : mapping{nullptr}, size{0}
+    {
+        int const fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw 1;
+        }
+        off_t const length = lseek(fd, 0, SEEK_END);
+        if (length <= 0) {
+            close(fd);
+            throw 2;
+        }
+        size = static_cast<size_t>(length);
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw 3;
+        }
+    }
+    ~MappedFile() { munmap(mapping, size); }
+
+    uint8_t const* data() const { return static_cast<uint8_t const*>(mapping); }
+    size_t get_size() const { return size; }
+
+    // Records of a section, throws unless they lie inside the file and are aligned for T.
+    template <typename T> T const* section(SceneFileSection const& section) const
+    {
+        if (section.offset % alignof(T) != 0 || section.offset > size ||
+            section.count > (size - section.offset) / sizeof(T)) {
+            throw 4;
+        }
+        return reinterpret_cast<T const*>(data() + section.offset);
+    }
+};
+
+class MappedSphere : public Object
+{
+    SphereRecord const* record;
+    Material const* mat;
+
+public:
+    MappedSphere(SphereRecord const* record, Material const* mat) : record(record), mat(mat) {}
+
+    bool hit(Ray& ray, Hit& hit_record) const
+    {
+        return hit_sphere(record->position, record->radius, ray, hit_record) && hit_record.on(this, *mat);
+    }
+
+    Material const& material() const { return *mat; }
+    AABB bounds() const
+    {
+        vec3 const extent{record->radius, record->radius, record->radius};
+        return AABB{record->position - extent, record->position + extent};
+    }
+    SphereRecord const& get_record() const { return *record; }
+};
+
+class MappedTriangle : public Object
+{
+    TriangleRecord const* record;
+    Material const* mat;
+
+public:
+    MappedTriangle(TriangleRecord const* record, Material const* mat) : record(record), mat(mat) {}
+
+    bool hit(Ray& ray, Hit& hit_record) const
+    {
+        return hit_triangle(record->positions, ray, hit_record) && hit_record.on(this, *mat);
+    }
+
+    Material const& material() const { return *mat; }
+    AABB bounds() const
+    {
+        AABB box{};
+        for (auto const& position : record->positions) {
+            box.extend(position);
+        }
+        return box;
+    }
+
+    std::array<AABB, 2> split_bounds(AABB const& box, size_t axis, float position) const
+    {
+        return split_polygon_bounds(record->positions, box, axis, position);
+    }
+    TriangleRecord const& get_record() const { return *record; }
+};
+
+// A loaded scene file together with the views into it, which must not move once the scene points at them.
+struct SceneFile {
+    MappedFile file;
+    std::vector<MappedSphere> spheres;
+    std::vector<MappedTriangle> triangles;
+
+    explicit SceneFile(std::string const& path) : file{path}, spheres{}, triangles{} {}
+};
+
+//
+// Scene
+//
+
+// Rays traced by the calling thread, read by the renderers for their rays/sec statistics.
+inline thread_local uint64_t traced_rays{0};
+
+class Scene
+{
+    std::vector<Light> lights;
+    std::vector<std::unique_ptr<RectangleLight>> rectangle_light_storage;
+    std::vector<std::unique_ptr<SphereLight>> sphere_light_storage;
+    std::vector<AreaLight*> area_lights;
+
+    std::vector<std::unique_ptr<Sphere>> sphere_storage;
+    std::vector<std::unique_ptr<Triangle>> triangle_storage;
+    std::vector<std::unique_ptr<Quad>> quad_storage;
+    std::vector<std::unique_ptr<Box>> box_storage;
+    std::vector<std::unique_ptr<Patch>> patch_storage;
+    std::vector<std::unique_ptr<MovingSphere>> moving_sphere_storage;
+    std::vector<std::unique_ptr<MovingTriangle>> moving_triangle_storage;
+    std::vector<std::unique_ptr<Plane>> plane_storage;
+    std::vector<std::unique_ptr<SceneFile>> scene_files;
+    std::vector<std::unique_ptr<MeshStorage<Mesh>>> mesh_storage;
+    std::vector<std::unique_ptr<MeshStorage<QuantizedMesh>>> quantized_mesh_storage;
+    // tested before the acceleration structure on every ray, their hits shorten the ray for it
+    std::vector<Object*> unbounded_objects;
+    std::vector<Object*> objects;
+    std::vector<AABB> object_bounds;
+    AABB bounds;
+    bool motion;
+    std::unique_ptr<Accelerator> accelerator;
+    GeometryCache geometry_cache;
+
+    void push_object(Object* object)
+    {
+        objects.push_back(object);
+        object_bounds.push_back(object->bounds());
+        bounds.extend(object_bounds.back());
+        motion |= object->moving();
+        // stale once the object list changes, rebuild with build()
+        accelerator.reset();
+    }
+
+    // Bulk insertion for large meshes, the triangle and quad views are created and bounded in parallel.
+    template <typename M> void push_mesh(M&& mesh, std::vector<std::unique_ptr<MeshStorage<M>>>& storage_list)
+    {
+        constexpr size_t ChunkSize = 1 << 14;
+
+        auto storage = std::make_unique<MeshStorage<M>>(std::move(mesh));
+        M const& stored = storage->mesh;
+        size_t const triangle_count = stored.triangle_count();
+        size_t const count = triangle_count + stored.quad_count();
+        size_t const first = objects.size();
+        storage->triangles.reserve(triangle_count);
+        for (size_t k = 0; k < triangle_count; k++) {
+            storage->triangles.emplace_back(&stored, static_cast<uint32_t>(k));
+        }
+        storage->quads.reserve(stored.quad_count());
+        for (size_t k = 0; k < stored.quad_count(); k++) {
+            storage->quads.emplace_back(&stored, static_cast<uint32_t>(k));
+        }
+        objects.resize(first + count);
+        object_bounds.resize(first + count);
+        size_t const chunks = (count + ChunkSize - 1) / ChunkSize;
+        std::vector<AABB> chunk_bounds(chunks);
+        // triangles first, then quads
+        parallel_for(chunks, [&](size_t chunk) {
+            for (size_t k = chunk * ChunkSize; k < std::min(count, (chunk + 1) * ChunkSize); k++) {
+                if (k < triangle_count) {
+                    objects[first + k] = &storage->triangles[k];
+                    object_bounds[first + k] = storage->triangles[k].bounds();
+                } else {
+                    objects[first + k] = &storage->quads[k - triangle_count];
+                    object_bounds[first + k] = storage->quads[k - triangle_count].bounds();
+                }
+                chunk_bounds[chunk].extend(object_bounds[first + k]);
+            }
+        });
+        for (auto const& box : chunk_bounds) {
+            bounds.extend(box);
+        }
+        storage_list.push_back(std::move(storage));
+        accelerator.reset();
+    }
+
+public:
+    Scene()
+        : lights{}, rectangle_light_storage{}, sphere_light_storage{}, area_lights{}, sphere_storage{},
+          triangle_storage{}, quad_storage{}, box_storage{}, patch_storage{}, moving_sphere_storage{},
+          moving_triangle_storage{}, plane_storage{}, scene_files{}, mesh_storage{}, quantized_mesh_storage{},
+          unbounded_objects{}, objects{}, object_bounds{}, bounds{}, motion{false}, accelerator{},
+          geometry_cache{size_t{64} << 20} {};
+    Scene(const Scene&) = delete;
+    Scene(Scene&&) = delete;
+    Scene& operator=(const Scene&) = delete;
+    Scene& operator=(Scene&&) = delete;
+
+    void push_object(Sphere&& sphere)
+    {
+        sphere_storage.push_back(std::make_unique<Sphere>(std::move(sphere)));
+        push_object(static_cast<Object*>(sphere_storage[sphere_storage.size() - 1].get()));
+    }
+
+    void push_object(Triangle&& triangle)
+    {
+        triangle_storage.push_back(std::make_unique<Triangle>(std::move(triangle)));
+        push_object(static_cast<Object*>(triangle_storage[triangle_storage.size() - 1].get()));
+    }
+
+    void push_object(Quad&& quad)
+    {
+        quad_storage.push_back(std::make_unique<Quad>(std::move(quad)));
+        push_object(static_cast<Object*>(quad_storage.back().get()));
+    }
+
+    void push_object(Box&& box)
+    {
+        box_storage.push_back(std::make_unique<Box>(std::move(box)));
+        push_object(static_cast<Object*>(box_storage.back().get()));
+    }
+
+    void push_object(Patch&& patch)
+    {
+        patch_storage.push_back(std::make_unique<Patch>(std::move(patch)));
+        push_object(static_cast<Object*>(patch_storage.back().get()));
+    }
+
+    void push_object(MovingSphere&& sphere)
+    {
+        moving_sphere_storage.push_back(std::make_unique<MovingSphere>(std::move(sphere)));
+        push_object(static_cast<Object*>(moving_sphere_storage.back().get()));
+    }
+
+    void push_object(MovingTriangle&& triangle)
+    {
+        moving_triangle_storage.push_back(std::make_unique<MovingTriangle>(std::move(triangle)));
+        push_object(static_cast<Object*>(moving_triangle_storage.back().get()));
+    }
+
+    void push_object(Plane&& plane)
+    {
+        plane_storage.push_back(std::make_unique<Plane>(std::move(plane)));
+        unbounded_objects.push_back(static_cast<Object*>(plane_storage.back().get()));
+    }
+
+    // Throws when a triangle or quad indexes past the positions.
+    void push_mesh(Mesh&& mesh)
+    {
+        for (auto const& corners : mesh.triangles) {
+            if (std::max({corners[0], corners[1], corners[2]}) >= mesh.positions.size()) {
+                throw 10;
+            }
+        }
+        for (auto const& corners : mesh.quads) {
+            if (std::max({corners[0], corners[1], corners[2], corners[3]}) >= mesh.positions.size()) {
+                throw 10;
+            }
+        }
+        push_mesh(std::move(mesh), mesh_storage);
+    }
+
+    void push_mesh(QuantizedMesh&& mesh) { push_mesh(std::move(mesh), quantized_mesh_storage); }
+
+    void push_light(Light&& light) { lights.push_back(std::move(light)); }
+
+    void push_light(RectangleLight&& light)
+    {
+        rectangle_light_storage.push_back(std::make_unique<RectangleLight>(std::move(light)));
+        area_lights.push_back(static_cast<AreaLight*>(rectangle_light_storage.back().get()));
+    }
+
+    void push_light(SphereLight&& light)
+    {
+        sphere_light_storage.push_back(std::make_unique<SphereLight>(std::move(light)));
+        area_lights.push_back(static_cast<AreaLight*>(sphere_light_storage.back().get()));
+    }
+
+    // Adds the contents of a binary scene file, see SceneFileHeader. The file stays mapped for the scene's lifetime.
+    void load(std::string const& path)
+    {
+        auto scene_file = std::make_unique<SceneFile>(path);
+        MappedFile const& file = scene_file->file;
+        if (file.get_size() < sizeof(SceneFileHeader)) {
+            throw 5;
+        }
+        SceneFileHeader header{};
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (header.magic != std::array<char, 8>{'B', 'B', '2', 'S', 'C', 'E', 'N', 'E'} ||
+            header.version != SceneFileVersion) {
+            throw 6;
+        }
+        Material const* const materials = file.section<Material>(header.materials);
+        auto const material = [&](uint32_t index) {
+            if (index >= header.materials.count) {
+                throw 7;
+            }
+            return &materials[index];
+        };
+
+        LightRecord const* const light_records = file.section<LightRecord>(header.lights);
+        for (size_t k = 0; k < header.lights.count; k++) {
+            push_light(Light(light_records[k].position, light_records[k].color));
+        }
+        SphereLightRecord const* const sphere_light_records = file.section<SphereLightRecord>(header.sphere_lights);
+        for (size_t k = 0; k < header.sphere_lights.count; k++) {
+            auto const& record = sphere_light_records[k];
+            push_light(SphereLight(record.position, record.radius, record.color));
+        }
+        PlaneRecord const* const plane_records = file.section<PlaneRecord>(header.planes);
+        for (size_t k = 0; k < header.planes.count; k++) {
+            auto const& record = plane_records[k];
+            push_object(Plane(record.offset * record.normal, record.normal, *material(record.material)));
+        }
+
+        SphereRecord const* const sphere_records = file.section<SphereRecord>(header.spheres);
+        scene_file->spheres.reserve(header.spheres.count);
+        for (size_t k = 0; k < header.spheres.count; k++) {
+            scene_file->spheres.emplace_back(&sphere_records[k], material(sphere_records[k].material));
+        }
+        TriangleRecord const* const triangle_records = file.section<TriangleRecord>(header.triangles);
+        scene_file->triangles.reserve(header.triangles.count);
+        for (size_t k = 0; k < header.triangles.count; k++) {
+            scene_file->triangles.emplace_back(&triangle_records[k], material(triangle_records[k].material));
+        }
+        objects.reserve(objects.size() + header.spheres.count + header.triangles.count);
+        object_bounds.reserve(objects.capacity());
+        for (auto& sphere : scene_file->spheres) {
+            push_object(static_cast<Object*>(&sphere));
+        }
+        for (auto& triangle : scene_file->triangles) {
+            push_object(static_cast<Object*>(&triangle));
+        }
+        scene_files.push_back(std::move(scene_file));
+    }
+
+    // Writes the scene as a binary scene file. Only point and sphere lights, planes, spheres and triangles have a
+    // record, anything else throws.
+    void save(std::string const& path) const
+    {
+        if (!rectangle_light_storage.empty() || !quad_storage.empty() || !box_storage.empty() ||
+            !patch_storage.empty() || !moving_sphere_storage.empty() || !moving_triangle_storage.empty()) {
+            throw 8;
+        }
+        std::vector<Material> materials{};
+        auto const material_index = [&](Material const& material) {
+            for (size_t k = 0; k < materials.size(); k++) {
+                if (std::memcmp(&materials[k], &material, sizeof(Material)) == 0) {
+                    return static_cast<uint32_t>(k);
+                }
+            }
+            materials.push_back(material);
+            return static_cast<uint32_t>(materials.size() - 1);
+        };
+
+        std::vector<LightRecord> light_records{};
+        for (auto const& light : lights) {
+            light_records.push_back({light.position, light.color});
+        }
+        std::vector<SphereLightRecord> sphere_light_records{};
+        for (auto const& light : sphere_light_storage) {
+            sphere_light_records.push_back({light->get_position(), light->get_radius(), light->get_color()});
+        }
+        std::vector<PlaneRecord> plane_records{};
+        for (auto const& plane : plane_storage) {
+            plane_records.push_back({plane->get_normal(), plane->get_offset(), material_index(plane->material())});
+        }
+        std::vector<SphereRecord> sphere_records{};
+        for (auto const& sphere : sphere_storage) {
+            sphere_records.push_back(
+                {sphere->get_position(), sphere->get_radius(), material_index(sphere->material())}
+            );
+        }
+        std::vector<TriangleRecord> triangle_records{};
+        for (auto const& triangle : triangle_storage) {
+            triangle_records.push_back({triangle->get_positions(), material_index(triangle->material())});
+        }
+        auto const save_meshes = [&](auto const& storage_list) {
+            for (auto const& storage : storage_list) {
+                uint32_t const material = material_index(storage->mesh.material);
+                for (auto const& triangle : storage->triangles) {
+                    triangle_records.push_back({triangle.positions(), material});
+                }
+                // the scene format has no quads, each is saved as its two triangles
+                for (auto const& quad : storage->quads) {
+                    auto const corners = quad.positions();
+                    triangle_records.push_back({{corners[0], corners[1], corners[2]}, material});
+                    triangle_records.push_back({{corners[0], corners[2], corners[3]}, material});
+                }
+            }
+        };
+        save_meshes(mesh_storage);
+        save_meshes(quantized_mesh_storage);
+        for (auto const& scene_file : scene_files) {
+            for (auto const& sphere : scene_file->spheres) {
+                sphere_records.push_back(sphere.get_record());
+                sphere_records.back().material = material_index(sphere.material());
+            }
+            for (auto const& triangle : scene_file->triangles) {
+                triangle_records.push_back(triangle.get_record());
+                triangle_records.back().material = material_index(triangle.material());
+            }
+        }
+
+        SceneFileHeader header{};
+        header.magic = {'B', 'B', '2', 'S', 'C', 'E', 'N', 'E'};
+        header.version = SceneFileVersion;
+        size_t end = sizeof(SceneFileHeader);
+        auto const place = [&](SceneFileSection& section, auto const& records) {
+            end = (end + SceneFileAlignment - 1) / SceneFileAlignment * SceneFileAlignment;
+            section = {end, records.size()};
+            end += records.size() * sizeof(records[0]);
+        };
+        place(header.materials, materials);
+        place(header.lights, light_records);
+        place(header.sphere_lights, sphere_light_records);
+        place(header.planes, plane_records);
+        place(header.spheres, sphere_records);
+        place(header.triangles, triangle_records);
+
+        FILE* file_ptr = fopen(path.c_str(), "wb");
+        if (file_ptr == nullptr) {
+            throw 1;
+        }
+        size_t written = 0;
+        auto const write = [&](void const* data, size_t bytes, size_t offset) {
+            static constexpr std::array<uint8_t, SceneFileAlignment> padding{};
+            written += fwrite(padding.data(), 1, offset - written, file_ptr);
+            written += fwrite(data, 1, bytes, file_ptr);
+        };
+        write(&header, sizeof(header), 0);
+        write(materials.data(), materials.size() * sizeof(Material), header.materials.offset);
+        write(light_records.data(), light_records.size() * sizeof(LightRecord), header.lights.offset);
+        write(sphere_light_records.data(), sphere_light_records.size() * sizeof(SphereLightRecord),
+              header.sphere_lights.offset);
+        write(plane_records.data(), plane_records.size() * sizeof(PlaneRecord), header.planes.offset);
+        write(sphere_records.data(), sphere_records.size() * sizeof(SphereRecord), header.spheres.offset);
+        write(triangle_records.data(), triangle_records.size() * sizeof(TriangleRecord), header.triangles.offset);
+        fclose(file_ptr);
+        if (written != end) {
+            throw 2;
+        }
+    }
+
+    // Bounded objects only, planes are kept apart.
+    std::vector<Object*> const& get_objects() const { return objects; };
+    std::vector<Light> const& get_lights() const { return lights; };
+    std::vector<AreaLight*> const& get_area_lights() const { return area_lights; };
+    AABB const& get_bounds() const { return bounds; };
+    // Shared by every patch of the scene.
+    GeometryCache& get_geometry_cache() { return geometry_cache; };
+    GeometryCache const& get_geometry_cache() const { return geometry_cache; };
+    bool has_patches() const { return !patch_storage.empty(); };
+    // Whether rays need a time in the shutter interval.
+    bool has_motion() const { return motion; };
+
+    // Builds the acceleration structure used by intersect and occluded, List keeps the plain culled loop. The other
+    // structures hold moving objects by their bounds over the whole shutter, Bvh switches to MotionBvh instead.
+    void build(AcceleratorType type)
+    {
+        accelerator.reset();
+        if (type == AcceleratorType::Grid) {
+            accelerator = std::make_unique<Grid>(objects, object_bounds, bounds);
+        } else if (type == AcceleratorType::KdTree) {
+            accelerator = std::make_unique<KdTree>(objects, object_bounds, bounds);
+        } else if (type == AcceleratorType::Bvh && motion) {
+            accelerator = std::make_unique<MotionBvh>(objects);
+        } else if (type == AcceleratorType::Bvh) {
+            accelerator = std::make_unique<Bvh>(objects, object_bounds, bounds);
+        }
+    }
+
+    // Closest hit along the ray, shortening ray.t to it and recording it.
+    bool intersect(Ray& ray, Hit& record) const
+    {
+        traced_rays++;
+        bool found{false};
+        for (auto const object : unbounded_objects) {
+            found |= object->hit(ray, record);
+        }
+        if (accelerator) {
+            return accelerator->intersect(ray, record) || found;
+        }
+        if (!bounds.hit(ray)) {
+            return found;
+        }
+        for (size_t k = 0; k < objects.size(); k++) {
+            if (object_bounds[k].hit(ray) && objects[k]->hit(ray, record)) {
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    // Any hit along the ray closer than ray.t.
+    bool occluded(Ray& ray) const
+    {
+        traced_rays++;
+        Hit record{};
+        for (auto const object : unbounded_objects) {
+            if (object->hit(ray, record)) {
+                return true;
+            }
+        }
+        if (accelerator) {
+            return accelerator->occluded(ray);
+        }
+        if (!bounds.hit(ray)) {
+            return false;
+        }
+        for (size_t k = 0; k < objects.size(); k++) {
+            if (object_bounds[k].hit(ray) && objects[k]->hit(ray, record)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+//
+// Mesh import
+//
+// Text meshes are mapped and cut into chunks at line boundaries that are parsed concurrently with std::from_chars.
+// OBJ chunks collect their own vertices and faces, indices relative to the current vertex (negative ones) are
+// resolved once the vertex counts of the preceding chunks are known. ASCII PLY declares its element counts up front
+// so a first pass counts the lines of every chunk, after which vertices are written straight to their final slot.
+// Quads are kept as quads, other polygons are triangulated as fans, everything but positions and faces is skipped.
+//
+// Line aligned [begin, end) ranges of roughly equal size covering text.
+std::vector<std::pair<size_t, size_t>> split_lines(char const* text, size_t size)
+{
+    constexpr size_t MinimumChunk = 1 << 16;
+
+    size_t const workers = std::max(1u, std::thread::hardware_concurrency());
+    size_t const chunks = std::max<size_t>(1, std::min(workers * 4, size / MinimumChunk));
+    std::vector<std::pair<size_t, size_t>> ranges{};
+    size_t begin = 0;
+    for (size_t k = 1; k <= chunks && begin < size; k++) {
+        size_t end = (k == chunks) ? size : std::max(begin, k * size / chunks);
+        while (end < size && text[end - 1] != '\n') {
+            end++;
+        }
+        ranges.push_back({begin, end});
+        begin = end;
+    }
+    return ranges;
+}
+
+bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Parses the next blank separated number of a line, throws on malformed input.
+template <typename T> T parse_number(char const*& p, char const* end)
+{
+    while (p < end && is_blank(*p)) {
+        p++;
+    }
+    T value{};
+    auto const [next, error] = std::from_chars(p, end, value);
+    if (error != std::errc{}) {
+        throw 11;
+    }
+    p = next;
+    return value;
+}
+
+// Appends polygon to quads if it has four corners, otherwise its fan triangulation to triangles.
+template <typename Index>
+void add_polygon(
+    std::vector<Index> const& polygon,
+    std::vector<std::array<Index, 3>>& triangles,
+    std::vector<std::array<Index, 4>>& quads
+)
+{
+    if (polygon.size() == 4) {
+        quads.push_back({polygon[0], polygon[1], polygon[2], polygon[3]});
+        return;
+    }
+    for (size_t k = 2; k < polygon.size(); k++) {
+        triangles.push_back({polygon[0], polygon[k - 1], polygon[k]});
+    }
+}
+
+Mesh load_obj(MappedFile const& file)
+{
+    struct Chunk {
+        std::vector<vec3> positions;
+        // absolute indices are stored as is, relative ones as their offset from the chunk's first position minus
+        // RelativeBias, which may reach back into earlier chunks
+        std::vector<std::array<int64_t, 3>> triangles;
+        std::vector<std::array<int64_t, 4>> quads;
+    };
+    constexpr int64_t RelativeBias = int64_t{1} << 62;
+
+    char const* const text = reinterpret_cast<char const*>(file.data());
+    auto const ranges = split_lines(text, file.get_size());
+    std::vector<Chunk> chunks(ranges.size());
+    parallel_for(ranges.size(), [&](size_t c) {
+        Chunk& chunk = chunks[c];
+        std::vector<int64_t> polygon{};
+        char const* line = text + ranges[c].first;
+        char const* const chunk_end = text + ranges[c].second;
+        while (line < chunk_end) {
+            char const* const end = std::find(line, chunk_end, '\n');
+            char const* p = line;
+            while (p < end && is_blank(*p)) {
+                p++;
+            }
+            if (end - p > 2 && p[0] == 'v' && is_blank(p[1])) {
+                p++;
+                float const x = parse_number<float>(p, end);
+                float const y = parse_number<float>(p, end);
+                float const z = parse_number<float>(p, end);
+                chunk.positions.push_back({x, y, z});
+            } else if (end - p > 2 && p[0] == 'f' && is_blank(p[1])) {
+                p++;
+                polygon.clear();
+                while (true) {
+                    while (p < end && is_blank(*p)) {
+                        p++;
+                    }
+                    if (p == end) {
+                        break;
+                    }
+                    int64_t const index = parse_number<int64_t>(p, end);
+                    if (index == 0) {
+                        throw 12;
+                    }
+                    int64_t const local = static_cast<int64_t>(chunk.positions.size()) + index;
+                    polygon.push_back(index > 0 ? index - 1 : local - RelativeBias);
+                    // texture and normal indices
+                    while (p < end && !is_blank(*p)) {
+                        p++;
+                    }
+                }
+                add_polygon(polygon, chunk.triangles, chunk.quads);
+            }
+            line = end + 1;
+        }
+    });
+
+    Mesh mesh{};
+    std::vector<size_t> offsets(chunks.size() + 1, 0);
+    std::vector<size_t> triangle_offsets(chunks.size() + 1, 0);
+    std::vector<size_t> quad_offsets(chunks.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); c++) {
+        offsets[c + 1] = offsets[c] + chunks[c].positions.size();
+        triangle_offsets[c + 1] = triangle_offsets[c] + chunks[c].triangles.size();
+        quad_offsets[c + 1] = quad_offsets[c] + chunks[c].quads.size();
+    }
+    mesh.positions.resize(offsets.back());
+    mesh.triangles.resize(triangle_offsets.back());
+    mesh.quads.resize(quad_offsets.back());
+    parallel_for(chunks.size(), [&](size_t c) {
+        std::copy(chunks[c].positions.begin(), chunks[c].positions.end(), mesh.positions.begin() + offsets[c]);
+        auto const resolve = [&](auto const& faces, auto destination) {
+            for (auto const& face : faces) {
+                for (size_t corner = 0; corner < face.size(); corner++) {
+                    int64_t const index = face[corner];
+                    int64_t const resolved =
+                        index >= 0 ? index : static_cast<int64_t>(offsets[c]) + index + RelativeBias;
+                    if (resolved < 0 || static_cast<size_t>(resolved) >= offsets.back()) {
+                        throw 10;
+                    }
+                    (*destination)[corner] = static_cast<uint32_t>(resolved);
+                }
+                destination++;
+            }
+        };
+        resolve(chunks[c].triangles, mesh.triangles.begin() + triangle_offsets[c]);
+        resolve(chunks[c].quads, mesh.quads.begin() + quad_offsets[c]);
+    });
+    return mesh;
+}
+
+enum class PlyType { Int8, Uint8, Int16, Uint16, Int32, Uint32, Float32, Float64 };
+
+PlyType ply_type(std::string const& name)
+{
+    if (name == "char" || name == "int8") {
+        return PlyType::Int8;
+    } else if (name == "uchar" || name == "uint8") {
+        return PlyType::Uint8;
+    } else if (name == "short" || name == "int16") {
+        return PlyType::Int16;
+    } else if (name == "ushort" || name == "uint16") {
+        return PlyType::Uint16;
+    } else if (name == "int" || name == "int32") {
+        return PlyType::Int32;
+    } else if (name == "uint" || name == "uint32") {
+        return PlyType::Uint32;
+    } else if (name == "float" || name == "float32") {
+        return PlyType::Float32;
+    } else if (name == "double" || name == "float64") {
+        return PlyType::Float64;
+    }
+    throw 13;
+}
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    // element count type of list properties
+    PlyType count_type;
+    bool list;
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+struct PlyHeader {
+    std::string format;
+    std::vector<PlyElement> elements;
+    // bytes up to and including the end_header line
+    size_t size;
+};
+
+PlyHeader parse_ply_header(MappedFile const& file)
+{
+    char const* const text = reinterpret_cast<char const*>(file.data());
+    char const* const file_end = text + file.get_size();
+    PlyHeader header{};
+    char const* line = text;
+    bool magic = false;
+    while (line < file_end) {
+        char const* const end = std::find(line, file_end, '\n');
+        std::vector<std::string> words{};
+        for (char const* p = line; p < end;) {
+            while (p < end && is_blank(*p)) {
+                p++;
+            }
+            char const* const word = p;
+            while (p < end && !is_blank(*p)) {
+                p++;
+            }
+            if (p > word) {
+                words.emplace_back(word, p);
+            }
+        }
+        line = end + 1;
+        if (!magic) {
+            if (words.size() != 1 || words[0] != "ply") {
+                throw 13;
+            }
+            magic = true;
+        } else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+            continue;
+        } else if (words[0] == "format" && words.size() == 3) {
+            header.format = words[1];
+        } else if (words[0] == "element" && words.size() == 3) {
+            header.elements.push_back({words[1], std::stoul(words[2]), {}});
+        } else if (words[0] == "property" && words.size() == 3 && !header.elements.empty()) {
+            header.elements.back().properties.push_back({words[2], ply_type(words[1]), PlyType::Uint8, false});
+        } else if (words[0] == "property" && words.size() == 5 && words[1] == "list" && !header.elements.empty()) {
+            header.elements.back().properties.push_back({words[4], ply_type(words[3]), ply_type(words[2]), true});
+        } else if (words[0] == "end_header") {
+            header.size = static_cast<size_t>(line - text);
+            return header;
+        } else {
+            throw 13;
+        }
+    }
+    throw 13;
+}
+
+Mesh load_ascii_ply(MappedFile const& file, PlyHeader const& header)
+{
+    char const* const text = reinterpret_cast<char const*>(file.data()) + header.size;
+    size_t const size = file.get_size() - header.size;
+
+    // first line of every element, the body holds one line per element instance
+    std::vector<size_t> element_lines(header.elements.size() + 1, 0);
+    for (size_t e = 0; e < header.elements.size(); e++) {
+        element_lines[e + 1] = element_lines[e] + header.elements[e].count;
+    }
+    auto const ranges = split_lines(text, size);
+    std::vector<size_t> first_lines(ranges.size() + 1, 0);
+    parallel_for(ranges.size(), [&](size_t c) {
+        first_lines[c + 1] = std::count(text + ranges[c].first, text + ranges[c].second, '\n');
+    });
+    for (size_t c = 0; c < ranges.size(); c++) {
+        first_lines[c + 1] += first_lines[c];
+    }
+
+    Mesh mesh{};
+    size_t vertex_element = header.elements.size();
+    std::array<size_t, 3> coordinates{};
+    for (size_t e = 0; e < header.elements.size(); e++) {
+        if (header.elements[e].name != "vertex") {
+            continue;
+        }
+        vertex_element = e;
+        auto const& properties = header.elements[e].properties;
+        for (size_t axis = 0; axis < 3; axis++) {
+            auto const found = std::find_if(properties.begin(), properties.end(), [&](PlyProperty const& property) {
+                return property.name == std::array<char const*, 3>{"x", "y", "z"}[axis];
+            });
+            if (found == properties.end()) {
+                throw 13;
+            }
+            coordinates[axis] = static_cast<size_t>(found - properties.begin());
+        }
+        mesh.positions.resize(header.elements[e].count);
+    }
+    std::vector<std::vector<std::array<uint32_t, 3>>> chunk_triangles(ranges.size());
+    std::vector<std::vector<std::array<uint32_t, 4>>> chunk_quads(ranges.size());
+
+    parallel_for(ranges.size(), [&](size_t c) {
+        std::vector<double> values{};
+        std::vector<uint32_t> polygon{};
+        size_t line_index = first_lines[c];
+        char const* line = text + ranges[c].first;
+        char const* const chunk_end = text + ranges[c].second;
+        for (; line < chunk_end; line_index++) {
+            char const* const end = std::find(line, chunk_end, '\n');
+            size_t const e = std::upper_bound(element_lines.begin(), element_lines.end(), line_index) -
+                             element_lines.begin() - 1;
+            char const* p = line;
+            line = end + 1;
+            if (e >= header.elements.size()) {
+                continue;
+            }
+            PlyElement const& element = header.elements[e];
+            if (e == vertex_element) {
+                values.clear();
+                for (auto const& property : element.properties) {
+                    if (property.list) {
+                        throw 13;
+                    }
+                    values.push_back(parse_number<double>(p, end));
+                }
+                mesh.positions[line_index - element_lines[e]] = {static_cast<float>(values[coordinates[0]]),
+                                                                 static_cast<float>(values[coordinates[1]]),
+                                                                 static_cast<float>(values[coordinates[2]])};
+            } else if (element.name == "face") {
+                for (auto const& property : element.properties) {
+                    bool const indices = property.name == "vertex_indices" || property.name == "vertex_index";
+                    size_t const count = property.list ? parse_number<size_t>(p, end) : 1;
+                    polygon.clear();
+                    for (size_t k = 0; k < count; k++) {
+                        if (indices) {
+                            polygon.push_back(parse_number<uint32_t>(p, end));
+                        } else {
+                            parse_number<double>(p, end);
+                        }
+                    }
+                    if (indices) {
+                        add_polygon(polygon, chunk_triangles[c], chunk_quads[c]);
+                    }
+                }
+            }
+        }
+    });
+    for (auto const& triangles : chunk_triangles) {
+        mesh.triangles.insert(mesh.triangles.end(), triangles.begin(), triangles.end());
+    }
+    for (auto const& quads : chunk_quads) {
+        mesh.quads.insert(mesh.quads.end(), quads.begin(), quads.end());
+    }
+    return mesh;
+}
+
+size_t ply_type_size(PlyType type)
+{
+    constexpr std::array<size_t, 8> sizes{1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[static_cast<size_t>(type)];
+}
+
+// Binary PLY scalar at p, byte swapped first when the file's byte order differs from the host's.
+template <typename T> T read_ply_scalar(uint8_t const* p, PlyType type, bool swap)
+{
+    auto const as = [&]<typename S>(S value) {
+        std::memcpy(&value, p, sizeof(S));
+        if (swap) {
+            auto bytes = std::bit_cast<std::array<uint8_t, sizeof(S)>>(value);
+            std::reverse(bytes.begin(), bytes.end());
+            value = std::bit_cast<S>(bytes);
+        }
+        return static_cast<T>(value);
+    };
+    switch (type) {
+    case PlyType::Int8:
+        return as(int8_t{});
+    case PlyType::Uint8:
+        return as(uint8_t{});
+    case PlyType::Int16:
+        return as(int16_t{});
+    case PlyType::Uint16:
+        return as(uint16_t{});
+    case PlyType::Int32:
+        return as(int32_t{});
+    case PlyType::Uint32:
+        return as(uint32_t{});
+    case PlyType::Float32:
+        return as(float{});
+    case PlyType::Float64:
+        break;
+    }
+    return as(double{});
+}
+
+// Bytes of one element instance starting at p, lists are sized by reading their count.
+size_t ply_record_size(uint8_t const* p, uint8_t const* end, PlyElement const& element, bool swap)
+{
+    size_t size = 0;
+    for (auto const& property : element.properties) {
+        if (!property.list) {
+            size += ply_type_size(property.type);
+            continue;
+        }
+        if (p + size + ply_type_size(property.count_type) > end) {
+            throw 16;
+        }
+        size_t const count = read_ply_scalar<size_t>(p + size, property.count_type, swap);
+        size += ply_type_size(property.count_type) + count * ply_type_size(property.type);
+    }
+    return size;
+}
+
+// Vertices are copied in one block when they are bare host order float x, y, z triples and converted in parallel
+// otherwise. Faces are gathered in parallel when every one is a triangle at a fixed stride, the common case for
+// scans, and walked record by record otherwise.
+Mesh load_binary_ply(MappedFile const& file, PlyHeader const& header)
+{
+    constexpr size_t ChunkSize = 1 << 16;
+
+    bool const swap = (header.format == "binary_big_endian") != (std::endian::native == std::endian::big);
+    uint8_t const* p = file.data() + header.size;
+    uint8_t const* const end = file.data() + file.get_size();
+    Mesh mesh{};
+    for (auto const& element : header.elements) {
+        bool const fixed = std::none_of(element.properties.begin(), element.properties.end(), [](auto const& property) {
+            return property.list;
+        });
+
+        if (element.name == "vertex") {
+            if (!fixed) {
+                throw 13;
+            }
+            size_t stride = 0;
+            std::array<size_t, 3> offsets{};
+            std::array<PlyType, 3> types{};
+            std::array<bool, 3> found{};
+            for (auto const& property : element.properties) {
+                for (size_t axis = 0; axis < 3; axis++) {
+                    if (property.name == std::array<char const*, 3>{"x", "y", "z"}[axis]) {
+                        offsets[axis] = stride;
+                        types[axis] = property.type;
+                        found[axis] = true;
+                    }
+                }
+                stride += ply_type_size(property.type);
+            }
+            if (!found[0] || !found[1] || !found[2]) {
+                throw 13;
+            }
+            if (static_cast<size_t>(end - p) / stride < element.count) {
+                throw 16;
+            }
+            mesh.positions.resize(element.count);
+            bool const packed = !swap && stride == sizeof(vec3) && offsets == std::array<size_t, 3>{0, 4, 8} &&
+                                std::all_of(types.begin(), types.end(), [](PlyType type) {
+                                    return type == PlyType::Float32;
+                                });
+            if (packed) {
+                std::memcpy(mesh.positions.data(), p, element.count * sizeof(vec3));
+            } else {
+                parallel_for((element.count + ChunkSize - 1) / ChunkSize, [&](size_t chunk) {
+                    for (size_t k = chunk * ChunkSize; k < std::min(element.count, (chunk + 1) * ChunkSize); k++) {
+                        for (size_t axis = 0; axis < 3; axis++) {
+                            mesh.positions[k][axis] =
+                                read_ply_scalar<float>(p + k * stride + offsets[axis], types[axis], swap);
+                        }
+                    }
+                });
+            }
+            p += element.count * stride;
+            continue;
+        }
+
+        if (element.name == "face") {
+            auto const is_indices = [](PlyProperty const& property) {
+                return property.name == "vertex_indices" || property.name == "vertex_index";
+            };
+            auto const indices = std::find_if(element.properties.begin(), element.properties.end(), is_indices);
+            if (indices == element.properties.end() || !indices->list) {
+                throw 13;
+            }
+            // offset of the index list and record size without its indices
+            size_t list_offset = 0;
+            size_t fixed_size = 0;
+            bool prefix_fixed = true;
+            for (auto property = element.properties.begin(); property != element.properties.end(); property++) {
+                if (property == indices) {
+                    list_offset = fixed_size;
+                    fixed_size += ply_type_size(property->count_type);
+                } else if (!property->list) {
+                    fixed_size += ply_type_size(property->type);
+                } else {
+                    prefix_fixed = false;
+                }
+            }
+            size_t const count_size = ply_type_size(indices->count_type);
+            size_t const index_size = ply_type_size(indices->type);
+            // records have a fixed size when every face has as many corners as the first, read in parallel if that
+            // is three or four
+            size_t corners = 0;
+            if (prefix_fixed && element.count > 0 && static_cast<size_t>(end - p) >= list_offset + count_size) {
+                corners = read_ply_scalar<size_t>(p + list_offset, indices->count_type, swap);
+            }
+            size_t const stride = fixed_size + corners * index_size;
+            bool uniform = (corners == 3 || corners == 4) && static_cast<size_t>(end - p) / stride >= element.count;
+            if (uniform) {
+                std::atomic<bool> all_uniform{true};
+                parallel_for((element.count + ChunkSize - 1) / ChunkSize, [&](size_t chunk) {
+                    for (size_t k = chunk * ChunkSize; k < std::min(element.count, (chunk + 1) * ChunkSize); k++) {
+                        if (read_ply_scalar<size_t>(p + k * stride + list_offset, indices->count_type, swap) !=
+                            corners) {
+                            all_uniform = false;
+                            return;
+                        }
+                    }
+                });
+                uniform = all_uniform;
+            }
+            if (uniform) {
+                auto const read_faces = [&](auto& faces) {
+                    size_t const first = faces.size();
+                    faces.resize(first + element.count);
+                    parallel_for((element.count + ChunkSize - 1) / ChunkSize, [&](size_t chunk) {
+                        for (size_t k = chunk * ChunkSize; k < std::min(element.count, (chunk + 1) * ChunkSize);
+                             k++) {
+                            uint8_t const* const list = p + k * stride + list_offset + count_size;
+                            for (size_t corner = 0; corner < corners; corner++) {
+                                faces[first + k][corner] =
+                                    read_ply_scalar<uint32_t>(list + corner * index_size, indices->type, swap);
+                            }
+                        }
+                    });
+                };
+                if (corners == 3) {
+                    read_faces(mesh.triangles);
+                } else {
+                    read_faces(mesh.quads);
+                }
+                p += element.count * stride;
+                continue;
+            }
+            std::vector<uint32_t> polygon{};
+            for (size_t k = 0; k < element.count; k++) {
+                uint8_t const* q = p;
+                for (auto property = element.properties.begin(); property != element.properties.end(); property++) {
+                    size_t count = 1;
+                    if (property->list) {
+                        if (q + ply_type_size(property->count_type) > end) {
+                            throw 16;
+                        }
+                        count = read_ply_scalar<size_t>(q, property->count_type, swap);
+                        q += ply_type_size(property->count_type);
+                    }
+                    if (static_cast<size_t>(end - q) / ply_type_size(property->type) < count) {
+                        throw 16;
+                    }
+                    if (property == indices) {
+                        polygon.clear();
+                        for (size_t corner = 0; corner < count; corner++) {
+                            polygon.push_back(read_ply_scalar<uint32_t>(q + corner * index_size, property->type, swap));
+                        }
+                        add_polygon(polygon, mesh.triangles, mesh.quads);
+                    }
+                    q += count * ply_type_size(property->type);
+                }
+                p = q;
+            }
+            continue;
+        }
+
+        for (size_t k = 0; k < element.count; k++) {
+            p += ply_record_size(p, end, element, swap);
+            if (p > end) {
+                throw 16;
+            }
+        }
+    }
+    return mesh;
+}
+
+Mesh load_ply(MappedFile const& file)
+{
+    PlyHeader const header = parse_ply_header(file);
+    if (header.format == "ascii") {
+        return load_ascii_ply(file, header);
+    }
+    if (header.format == "binary_little_endian" || header.format == "binary_big_endian") {
+        return load_binary_ply(file, header);
+    }
+    throw 14;
+}
+
+// Loads an OBJ or PLY file by its extension.
+Mesh load_mesh(std::string const& path)
+{
+    MappedFile const file{path};
+    std::string const extension = path.substr(std::min(path.size(), path.find_last_of('.')));
+    if (extension == ".obj" || extension == ".OBJ") {
+        return load_obj(file);
+    }
+    if (extension == ".ply" || extension == ".PLY") {
+        return load_ply(file);
+    }
+    throw 15;
+}
+
+//
+// Soft shadows
+//
+struct ShadowSettings {
+    size_t samples;
+    bool adaptive;
+
+    ShadowSettings() : samples{16}, adaptive{false} {}
+};
+
+// Mean of the cosine weighted visibility over an area light. Samples are jittered over a square grid of strata
+// sharing one low-discrepancy offset. In adaptive mode the four corner strata go first and, when they agree on
+// visibility, the point is taken to be fully lit or fully shadowed and the rest are skipped.
+float area_light_visibility(
+    Scene const& scene,
+    AreaLight const& light,
+    vec3 const& position,
+    vec3 const& normal,
+    float time,
+    Sampler& sampler,
+    ShadowSettings const& settings
+)
+{
+    size_t const strata = std::max<size_t>(1, static_cast<size_t>(std::sqrt(static_cast<float>(settings.samples))));
+    auto const [u, v] = sampler.get_2d();
+    auto const shade = [&](size_t sx, size_t sy, bool& visible) {
+        vec3 const target = light.sample(position, (sx + u) / strata, (sy + v) / strata);
+        vec3 const to_light = target - position;
+        float const distance = std::sqrt(dot(to_light, to_light));
+        vec3 const direction = to_light * (1.0f / distance);
+        float const cosine = dot(normal, direction);
+        visible = false;
+        if (cosine <= 0.0) {
+            return 0.0f;
+        }
+        Ray ray_to_light{position, direction, time};
+        ray_to_light.t = distance - eps;
+        visible = !scene.occluded(ray_to_light);
+        return visible ? cosine : 0.0f;
+    };
+
+    float total{0.0};
+    size_t const last = strata - 1;
+    if (settings.adaptive && strata > 2) {
+        size_t visible_count{0};
+        for (auto const [sx, sy] : std::array<std::array<size_t, 2>, 4>{{{0, 0}, {last, 0}, {0, last}, {last, last}}}) {
+            bool visible{};
+            total += shade(sx, sy, visible);
+            visible_count += visible;
+        }
+        if (visible_count == 0 || visible_count == 4) {
+            return total / 4.0f;
+        }
+    }
+    for (size_t sx = 0; sx < strata; sx++) {
+        for (size_t sy = 0; sy < strata; sy++) {
+            bool const corner = (sx == 0 || sx == last) && (sy == 0 || sy == last);
+            if (settings.adaptive && strata > 2 && corner) {
+                continue;
+            }
+            bool visible{};
+            total += shade(sx, sy, visible);
+        }
+    }
+    return total / static_cast<float>(strata * strata);
+}
+
+//
+// Camera
+//
+template <size_t Width, size_t Height> Ray primary_ray(float x, float y)
+{
+    return Ray{
+        {x - static_cast<float>(Width / 2), y - static_cast<float>(Height / 2), -1000.0},
+        {0, 0, 1}
+    };
+}
+
+//
+// Whitted
+//
+template <size_t Width, size_t Height, size_t MaxDepth>
+vec3 ray_trace(Scene const& scene, float x, float y, Sampler& sampler, ShadowSettings const& shadows)
+{
+    vec3 color{};
+    float intensity{1.0};
+    Ray ray = primary_ray<Width, Height>(x, y);
+    if (scene.has_motion()) {
+        ray.time = sampler.get_1d();
+    }
+
+    for (size_t depth = 0; depth < MaxDepth; depth++) {
+        Hit hit{};
+        if (!scene.intersect(ray, hit)) {
+            return color;
+        }
+
+        vec3 hit_position = ray.hit_position();
+        vec3 const hit_normal = hit.normal;
+        hit_position += hit_normal * eps;
+
+        Material const& hit_material = *hit.material;
+
+        // ambient
+        color += intensity * hit_material.ambient * hit_material.color;
+
+        // diffuse
+        for (auto const& light : scene.get_lights()) {
+            vec3 light_direction = normalize(light.position - hit_position);
+            float diffuse = dot(hit_normal, light_direction);
+            if (diffuse <= 0.0) {
+                continue;
+            }
+
+            Ray ray_to_light{hit_position, light_direction, ray.time};
+            if (!scene.occluded(ray_to_light)) {
+                color += intensity * hit_material.diffuse * diffuse * light.color * hit_material.color;
+            }
+        }
+        for (auto const light : scene.get_area_lights()) {
+            float const visibility =
+                area_light_visibility(scene, *light, hit_position, hit_normal, ray.time, sampler, shadows);
+            color += intensity * hit_material.diffuse * visibility * light->get_color() * hit_material.color;
+        }
+        intensity *= hit_material.reflect;
+        if (intensity < 0.01) {
+            return color;
+        }
+        vec3 const reflected = normalize(ray.direction - 2.0 * dot(ray.direction, hit_normal) * hit_normal);
+        ray = Ray(hit_position, reflected, ray.time);
+    }
+    return color;
+}
+
+//
+// Path tracing
+//
+float luminance(vec3 const& color) { return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2]; }
+
+// Primary hit data used to guide the denoiser, left zeroed when the camera ray misses.
+struct Features {
+    vec3 normal;
+    vec3 albedo;
+    float depth;
+
+    Features() : normal{}, albedo{}, depth{} {};
+};
+
+vec3 path_trace(
+    Scene const& scene,
+    Ray ray,
+    Sampler& sampler,
+    size_t max_bounces,
+    ShadowSettings const& shadows,
+    Features& features
+)
+{
+    vec3 color{};
+    vec3 throughput{1.0, 1.0, 1.0};
+
+    for (size_t bounce = 0; bounce <= max_bounces; bounce++) {
+        Hit hit{};
+        if (!scene.intersect(ray, hit)) {
+            break;
+        }
+
+        vec3 hit_position = ray.hit_position();
+        vec3 hit_normal = hit.normal;
+        // surfaces are two sided, shade the side the ray arrived from
+        if (dot(hit_normal, ray.direction) > 0.0) {
+            hit_normal = -1.0 * hit_normal;
+        }
+        hit_position += hit_normal * eps;
+
+        Material const& hit_material = *hit.material;
+        if (bounce == 0) {
+            features.normal = hit_normal;
+            features.albedo = hit_material.color;
+            features.depth = ray.t;
+        }
+
+        // ambient acts as a constant emission so both integrators share the material look
+        color += throughput * (hit_material.ambient * hit_material.color);
+
+        // next-event estimation
+        for (auto const& light : scene.get_lights()) {
+            vec3 const to_light = light.position - hit_position;
+            float const distance = std::sqrt(dot(to_light, to_light));
+            vec3 const light_direction = to_light * (1.0f / distance);
+            float const diffuse = dot(hit_normal, light_direction);
+            if (diffuse <= 0.0) {
+                continue;
+            }
+
+            Ray ray_to_light{hit_position, light_direction, ray.time};
+            ray_to_light.t = distance;
+            if (!scene.occluded(ray_to_light)) {
+                color += throughput * (hit_material.diffuse * diffuse) * light.color * hit_material.color;
+            }
+        }
+        for (auto const light : scene.get_area_lights()) {
+            float const visibility =
+                area_light_visibility(scene, *light, hit_position, hit_normal, ray.time, sampler, shadows);
+            color += throughput * (hit_material.diffuse * visibility) * light->get_color() * hit_material.color;
+        }
+
+        // reflect is the chance of a mirror bounce, the remainder scatters diffusely
+        float const lobe = sampler.get_1d();
+        auto const [u1, u2] = sampler.get_2d();
+        if (lobe < hit_material.reflect) {
+            vec3 const reflected = normalize(ray.direction - 2.0 * dot(ray.direction, hit_normal) * hit_normal);
+            ray = Ray(hit_position, reflected, ray.time);
+        } else {
+            throughput = throughput * (hit_material.diffuse * hit_material.color);
+            ray = Ray(hit_position, cosine_sample_hemisphere(hit_normal, u1, u2), ray.time);
+        }
+
+        // russian roulette
+        if (bounce >= 3) {
+            float const survive = std::min(1.0f, std::max({throughput[0], throughput[1], throughput[2]}));
+            if (sampler.get_1d() >= survive) {
+                break;
+            }
+            throughput = throughput * (1.0f / survive);
+        }
+    }
+    return color;
+}
+
+//
+// Accumulation
+//
+class Accumulator
+{
+    size_t width;
+    size_t height;
+    std::vector<vec3> sum;
+    std::vector<float> luminance_squares;
+    std::vector<Features> feature_sum;
+    std::vector<uint32_t> counts;
+
+    float scale(size_t index) const { return 1.0f / std::max<uint32_t>(counts[index], 1); }
+
+public:
+    Accumulator(size_t width, size_t height)
+        : width{width}, height{height}, sum(width * height), luminance_squares(width * height),
+          feature_sum(width * height), counts(width * height)
+    {
+    }
+    Accumulator(const Accumulator&) = delete;
+    Accumulator(Accumulator&&) = default;
+    Accumulator& operator=(const Accumulator&) = delete;
+    Accumulator& operator=(Accumulator&&) = default;
+
+    void add(size_t i, size_t j, vec3 const& value, Features const& features)
+    {
+        size_t const index = i * height + j;
+        sum[index] += value;
+        luminance_squares[index] += luminance(value) * luminance(value);
+        feature_sum[index].normal += features.normal;
+        feature_sum[index].albedo += features.albedo;
+        feature_sum[index].depth += features.depth;
+        counts[index]++;
+    }
+
+    size_t get_width() const { return width; }
+    size_t get_height() const { return height; }
+    size_t sample_count(size_t i, size_t j) const { return counts[i * height + j]; }
+    float mean_sample_count() const
+    {
+        double total{0.0};
+        for (auto const count : counts) {
+            total += count;
+        }
+        return static_cast<float>(total / counts.size());
+    }
+    vec3 resolve(size_t i, size_t j) const { return sum[i * height + j] * scale(i * height + j); }
+
+    Features resolve_features(size_t i, size_t j) const
+    {
+        size_t const index = i * height + j;
+        Features result{};
+        Features const& total = feature_sum[index];
+        result.normal = normalize(total.normal);
+        result.albedo = total.albedo * scale(index);
+        result.depth = total.depth * scale(index);
+        return result;
+    }
+
+    // Variance of the mean luminance estimate.
+    float luminance_variance(size_t i, size_t j) const
+    {
+        size_t const index = i * height + j;
+        float const mean = luminance(resolve(i, j));
+        float const mean_square = luminance_squares[index] * scale(index);
+        return std::max(0.0f, mean_square - mean * mean) * scale(index);
+    }
+};
+
+//
+// Denoising
+//
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance guided luminance weight of SVGF
+// (Schied et al. 2017). Buffers are planar so the per-row tap loops vectorize.
+//
+
+// Cheap exp for non-positive arguments, vectorizes where std::exp does not. Arguments are clamped to -30 so that
+// neither the weight nor its square turns denormal, which would stall the filter on flat zero-variance regions.
+// The clamp is written without a comparison since those block if-conversion under the default -ftrapping-math.
+inline float fast_exp(float x)
+{
+    float const y = 0.5f * (x - 30.0f + std::abs(x + 30.0f)) * 1.44269504f;
+    int32_t const k = static_cast<int32_t>(y);
+    float const f = y - static_cast<float>(k);
+    float const p = 1.0f + f * (0.6931472f + f * (0.2402265f + f * (0.0555041f + f * 0.0096181f)));
+    return p * std::bit_cast<float>((k + 127) << 23);
+}
+
+struct DenoiseSettings {
+    size_t iterations;
+    float sigma_luminance;
+    float sigma_normal;
+    float sigma_depth;
+    float sigma_albedo;
+
+    DenoiseSettings() : iterations{5}, sigma_luminance{4.0}, sigma_normal{0.1}, sigma_depth{1.0}, sigma_albedo{0.01} {}
+};
+
+class Denoiser
+{
+    size_t width;
+    size_t height;
+    std::array<std::vector<float>, 3> color;
+    std::vector<float> variance;
+    std::array<std::vector<float>, 3> normal;
+    std::array<std::vector<float>, 3> albedo;
+    std::vector<float> depth;
+
+    void filter(size_t step, DenoiseSettings const& settings)
+    {
+        static constexpr std::array<float, 5> kernel{1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0};
+        std::array<std::vector<float>, 3> filtered{
+            std::vector<float>(width * height), std::vector<float>(width * height), std::vector<float>(width * height)
+        };
+        std::vector<float> filtered_variance(width * height);
+
+        float const inverse_sigma_normal = 1.0f / settings.sigma_normal;
+        float const inverse_sigma_depth = 1.0f / (settings.sigma_depth * step);
+        float const inverse_sigma_albedo = 1.0f / settings.sigma_albedo;
+
+        // raw pointers keep the tap loop free of reloads through the vectors
+        float const* const cr = color[0].data();
+        float const* const cg = color[1].data();
+        float const* const cb = color[2].data();
+        float const* const nx = normal[0].data();
+        float const* const ny = normal[1].data();
+        float const* const nz = normal[2].data();
+        float const* const ar = albedo[0].data();
+        float const* const ag = albedo[1].data();
+        float const* const ab = albedo[2].data();
+        float const* const d = depth.data();
+        float const* const var = variance.data();
+
+        parallel_for(width, [&](size_t i) {
+            std::vector<float> weight_sum(height), r(height), g(height), b(height), v(height);
+            std::vector<float> luminance_p(height), inverse_sigma_luminance(height);
+            float* const ws = weight_sum.data();
+            float* const sr = r.data();
+            float* const sg = g.data();
+            float* const sb = b.data();
+            float* const sv = v.data();
+            float const* const lp = luminance_p.data();
+            float const* const isl = inverse_sigma_luminance.data();
+            long const row = static_cast<long>(i * height);
+            for (size_t j = 0; j < height; j++) {
+                luminance_p[j] = 0.2126f * cr[row + j] + 0.7152f * cg[row + j] + 0.0722f * cb[row + j];
+                inverse_sigma_luminance[j] = 1.0f / (settings.sigma_luminance * std::sqrt(var[row + j]) + 1e-4f);
+            }
+
+            for (long dx = -2; dx <= 2; dx++) {
+                long const qi = static_cast<long>(i) + dx * static_cast<long>(step);
+                if (qi < 0 || qi >= static_cast<long>(width)) {
+                    continue;
+                }
+                long const q_row = qi * static_cast<long>(height);
+                for (long dy = -2; dy <= 2; dy++) {
+                    long const offset = dy * static_cast<long>(step);
+                    long const j0 = std::max(0L, -offset);
+                    long const j1 = std::min(static_cast<long>(height), static_cast<long>(height) - offset);
+                    float const h = kernel[dx + 2] * kernel[dy + 2];
+                    // the per-row sums never alias the input planes
+#pragma GCC ivdep
+                    for (long j = j0; j < j1; j++) {
+                        long const p = row + j;
+                        long const q = q_row + j + offset;
+                        float const luminance_q = 0.2126f * cr[q] + 0.7152f * cg[q] + 0.0722f * cb[q];
+                        float const dn0 = nx[p] - nx[q];
+                        float const dn1 = ny[p] - ny[q];
+                        float const dn2 = nz[p] - nz[q];
+                        float const da0 = ar[p] - ar[q];
+                        float const da1 = ag[p] - ag[q];
+                        float const da2 = ab[p] - ab[q];
+                        float const exponent = std::abs(lp[j] - luminance_q) * isl[j] +
+                                               (dn0 * dn0 + dn1 * dn1 + dn2 * dn2) * inverse_sigma_normal +
+                                               std::abs(d[p] - d[q]) * inverse_sigma_depth +
+                                               (da0 * da0 + da1 * da1 + da2 * da2) * inverse_sigma_albedo;
+                        float const w = h * fast_exp(-exponent);
+                        ws[j] += w;
+                        sr[j] += w * cr[q];
+                        sg[j] += w * cg[q];
+                        sb[j] += w * cb[q];
+                        sv[j] += w * w * var[q];
+                    }
+                }
+            }
+
+            for (size_t j = 0; j < height; j++) {
+                float const inverse_weight = 1.0f / weight_sum[j];
+                filtered[0][row + j] = r[j] * inverse_weight;
+                filtered[1][row + j] = g[j] * inverse_weight;
+                filtered[2][row + j] = b[j] * inverse_weight;
+                filtered_variance[row + j] = v[j] * inverse_weight * inverse_weight;
+            }
+        });
+
+        color = std::move(filtered);
+        variance = std::move(filtered_variance);
+    }
+
+public:
+    explicit Denoiser(Accumulator const& accumulator)
+        : width{accumulator.get_width()}, height{accumulator.get_height()}, color{}, variance(width * height),
+          normal{}, albedo{}, depth(width * height)
+    {
+        for (size_t c = 0; c < 3; c++) {
+            color[c].resize(width * height);
+            normal[c].resize(width * height);
+            albedo[c].resize(width * height);
+        }
+        std::vector<float> raw_variance(width * height);
+        for (size_t i = 0; i < width; i++) {
+            for (size_t j = 0; j < height; j++) {
+                size_t const index = i * height + j;
+                vec3 const value = accumulator.resolve(i, j);
+                Features const features = accumulator.resolve_features(i, j);
+                for (size_t c = 0; c < 3; c++) {
+                    color[c][index] = value[c];
+                    normal[c][index] = features.normal[c];
+                    albedo[c][index] = features.albedo[c];
+                }
+                depth[index] = features.depth;
+                raw_variance[index] = accumulator.luminance_variance(i, j);
+            }
+        }
+        // a 3x3 box steadies the per-pixel variance estimate at low sample counts
+        for (size_t i = 0; i < width; i++) {
+            for (size_t j = 0; j < height; j++) {
+                float total{0.0};
+                size_t count{0};
+                for (size_t qi = (i > 0 ? i - 1 : 0); qi <= std::min(i + 1, width - 1); qi++) {
+                    for (size_t qj = (j > 0 ? j - 1 : 0); qj <= std::min(j + 1, height - 1); qj++) {
+                        total += raw_variance[qi * height + qj];
+                        count++;
+                    }
+                }
+                variance[i * height + j] = total / count;
+            }
+        }
+    }
+    Denoiser(const Denoiser&) = delete;
+    Denoiser(Denoiser&&) = default;
+    Denoiser& operator=(const Denoiser&) = delete;
+    Denoiser& operator=(Denoiser&&) = default;
+
+    void run(DenoiseSettings const& settings)
+    {
+        for (size_t iteration = 0; iteration < settings.iterations; iteration++) {
+            filter(size_t{1} << iteration, settings);
+        }
+    }
+
+    size_t get_width() const { return width; }
+    size_t get_height() const { return height; }
+
+    vec3 resolve(size_t i, size_t j) const
+    {
+        size_t const index = i * height + j;
+        return {color[0][index], color[1][index], color[2][index]};
+    }
+};
+
+//
+// Upscaling
+//
+
+// Resolution of one axis rendered at a fraction of the output size.
+size_t scaled_size(size_t size, float scale)
+{
+    return std::max<size_t>(1, static_cast<size_t>(std::lround(static_cast<float>(size) * scale)));
+}
+
+// Primary hit normal and depth for every output pixel, one ray each, to guide the upscaler.
+template <size_t Width, size_t Height> std::vector<Features> trace_guide(Scene const& scene)
+{
+    std::vector<Features> guide(Width * Height);
+    parallel_for(Width, [&](size_t i) {
+        for (size_t j = 0; j < Height; j++) {
+            Ray ray = primary_ray<Width, Height>(i, j);
+            // mid-shutter stands in for the motion blurred samples
+            ray.time = 0.5;
+            Hit hit{};
+            if (!scene.intersect(ray, hit)) {
+                continue;
+            }
+            Features& features = guide[i * Height + j];
+            features.normal = hit.normal;
+            if (dot(features.normal, ray.direction) > 0.0) {
+                features.normal = -1.0 * features.normal;
+            }
+            features.albedo = hit.material->color;
+            features.depth = ray.t;
+        }
+    });
+    return guide;
+}
+
+// Joint bilateral upsampling (Kopf et al. 2007) of a source rendered at scale times the output resolution. The 2x2
+// nearest source pixels are weighted bilinearly and by how well their averaged normal and depth match the full
+// resolution guide at output pixel (i, j), so colors do not bleed across silhouettes. When none of them match, the
+// best match in the surrounding 3x3 is used instead.
+template <typename Source>
+vec3 upscale_joint_bilateral(
+    Source const& source,
+    Accumulator const& accumulator,
+    Features const& guide,
+    float scale,
+    size_t i,
+    size_t j
+)
+{
+    size_t const width = source.get_width();
+    size_t const height = source.get_height();
+    float const x = std::clamp((i + 0.5f) * scale - 0.5f, 0.0f, static_cast<float>(width - 1));
+    float const y = std::clamp((j + 0.5f) * scale - 0.5f, 0.0f, static_cast<float>(height - 1));
+    size_t const i0 = static_cast<size_t>(x);
+    size_t const j0 = static_cast<size_t>(y);
+    float const fx = x - i0;
+    float const fy = y - j0;
+
+    auto const similarity = [&](size_t qi, size_t qj) {
+        Features const features = accumulator.resolve_features(qi, qj);
+        vec3 const dn = guide.normal - features.normal;
+        // one unit of depth per source pixel
+        return fast_exp(-(dot(dn, dn) * 10.0f + std::abs(guide.depth - features.depth) * scale));
+    };
+
+    vec3 color{};
+    float total{0.0};
+    for (size_t di = 0; di < 2; di++) {
+        for (size_t dj = 0; dj < 2; dj++) {
+            size_t const qi = std::min(i0 + di, width - 1);
+            size_t const qj = std::min(j0 + dj, height - 1);
+            float const w = (di ? fx : 1.0f - fx) * (dj ? fy : 1.0f - fy) * similarity(qi, qj);
+            color += w * source.resolve(qi, qj);
+            total += w;
+        }
+    }
+    if (total > 1e-6f) {
+        return color * (1.0f / total);
+    }
+
+    size_t const ci = static_cast<size_t>(std::lround(x));
+    size_t const cj = static_cast<size_t>(std::lround(y));
+    size_t best_i{ci};
+    size_t best_j{cj};
+    float best{-1.0};
+    for (size_t qi = (ci > 0 ? ci - 1 : 0); qi <= std::min(ci + 1, width - 1); qi++) {
+        for (size_t qj = (cj > 0 ? cj - 1 : 0); qj <= std::min(cj + 1, height - 1); qj++) {
+            float const w = similarity(qi, qj);
+            if (w > best) {
+                best = w;
+                best_i = qi;
+                best_j = qj;
+            }
+        }
+    }
+    return source.resolve(best_i, best_j);
+}
+
+// Writes the source into the image, upscaling with the guide when it was rendered at a lower resolution.
+template <size_t Width, size_t Height, typename Source>
+void resolve_image(
+    Image<Width, Height, ImageChannelType::RGBA>& img,
+    Source const& source,
+    Accumulator const& accumulator,
+    std::vector<Features> const& guide,
+    float scale
+)
+{
+    parallel_for(Width, [&](size_t i) {
+        for (size_t j = 0; j < Height; j++) {
+            vec3 const color = (scale == 1.0f)
+                                   ? source.resolve(i, j)
+                                   : upscale_joint_bilateral(source, accumulator, guide[i * Height + j], scale, i, j);
+            img.set(i, j, to_uints(color));
+        }
+    });
+}
+
 //
-int main()
+// Options
+//
+enum class Integrator { Whitted, Path };
+
+struct RenderSettings {
+    Integrator integrator;
+    SamplePattern sample_pattern;
+    size_t antialiasing;
+    size_t samples;
+    double time_budget;
+    float adaptive_threshold;
+    double deadline;
+    float resolution_scale;
+    size_t max_bounces;
+    ShadowSettings shadows;
+    bool area_lights;
+    bool denoise;
+    DenoiseSettings denoise_settings;
+    AcceleratorType accelerator;
+    bool plane;
+    bool patch;
+    size_t geometry_cache;
+    bool motion_blur;
+    size_t frames;
+    size_t fps;
+    OutputFormat output_format;
+    std::string framebuffer;
+    size_t banded;
+    size_t band_rows;
+    std::string scene;
+    std::string mesh;
+    float point_radius;
+    bool quantize;
+    std::string save_scene;
+    bool bench_accelerators;
+    std::string output;
+
+    RenderSettings()
+        : integrator{Integrator::Whitted}, sample_pattern{SamplePattern::Sobol}, antialiasing{1}, samples{64},
+          time_budget{0.0}, adaptive_threshold{0.0}, deadline{0.0},
+          resolution_scale{1.0}, max_bounces{8}, shadows{}, area_lights{false}, denoise{false},
+          denoise_settings{}, accelerator{AcceleratorType::List}, plane{false}, patch{false}, geometry_cache{64},
+          motion_blur{false}, frames{1}, fps{24}, output_format{OutputFormat::Png}, framebuffer{}, banded{0},
+          band_rows{64}, scene{}, mesh{}, point_radius{0.0}, quantize{false}, save_scene{}, bench_accelerators{false},
+          output{"example.png"}
+    {
+    }
+};
+
+void print_usage(char const* program)
 {
-    constexpr int Width = 512;
-    constexpr int Height = 512;
-    constexpr int Depth = 10;
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  --integrator whitted|path  rendering algorithm (default whitted)\n"
+              << "  --sampler sobol|random     sample pattern for every stochastic decision (default sobol)\n"
+              << "  --aa N                     whitted: samples per pixel for anti-aliasing (default 1)\n"
+              << "  --spp N                    path tracing: samples per pixel, 0 = unlimited (default 64)\n"
+              << "  --time SECONDS             path tracing: stop once the time budget is spent\n"
+              << "  --adaptive-threshold E     path tracing: retire tiles once their luminance error is below E\n"
+              << "  --scale S                  path tracing: render at S times the resolution and upscale, 0 < S <= 1\n"
+              << "  --deadline SECONDS         path tracing: trade resolution, bounces and samples to finish in time\n"
+              << "  --bounces N                path tracing: maximum bounce count (default 8)\n"
+              << "  --shadow-samples N         area light samples per shading point (default 16)\n"
+              << "  --adaptive-shadows         probe four samples first, take the rest only in penumbrae\n"
+              << "  --area-lights              light the default scene with sphere lights instead of points\n"
+              << "  --denoise                  path tracing: filter the accumulated image before quantizing\n"
+              << "  --denoise-passes N         a-trous iterations, each doubling the filter footprint (default 5)\n"
+              << "  --accel list|grid|kdtree|bvh\n"
+              << "                             acceleration structure for ray queries (default list)\n"
+              << "  --plane                    ground the default scene on an infinite plane, not a triangle\n"
+              << "  --patch                    add a lazily tessellated displaced patch to the default scene\n"
+              << "  --geometry-cache MB        memory cap of the patch tessellation cache (default 64)\n"
+              << "  --motion-blur              move the matte sphere during the shutter interval\n"
+              << "  --scene FILE               render a binary scene file instead of the default scene\n"
+              << "  --mesh FILE                render an OBJ or PLY mesh under the default lights\n"
+              << "  --points R                 render the mesh vertices as spheres of radius R, the default for\n"
+              << "                             meshes without faces (R = 1)\n"
+              << "  --quantize                 keep the mesh in 16 bit clusters, decoded on every intersection\n"
+              << "  --save-scene FILE          write the scene as a binary scene file, then exit\n"
+              << "  --frames N                 render N frames of the animated default scene as numbered images\n"
+              << "  --bench-accel              time construction and traversal of every structure, then exit,\n"
+              << "                             on --mesh full precision and quantized if given\n"
+              << "  --format png|rgb|rgba|y4m  output encoding, all but png append every frame to one stream\n"
+              << "  --fps N                    frame rate recorded in y4m streams (default 24)\n"
+              << "  --framebuffer FILE         render into a memory mapped raw image file instead of writing -o\n"
+              << "  --banded N                 render an N x N png band by band, memory grows with band height only,\n"
+              << "                             or into the --framebuffer file at any N\n"
+              << "  --band-rows N              image rows per band in banded mode (default 64)\n"
+              << "  -o FILE                    output file, - streams to stdout (default example.png)\n";
+}
+
+bool parse_arguments(int argc, char** argv, RenderSettings& settings)
+{
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string const arg{argv[i]};
+            if (arg == "--denoise") {
+                settings.denoise = true;
+                continue;
+            }
+            if (arg == "--adaptive-shadows") {
+                settings.shadows.adaptive = true;
+                continue;
+            }
+            if (arg == "--area-lights") {
+                settings.area_lights = true;
+                continue;
+            }
+            if (arg == "--plane") {
+                settings.plane = true;
+                continue;
+            }
+            if (arg == "--patch") {
+                settings.patch = true;
+                continue;
+            }
+            if (arg == "--motion-blur") {
+                settings.motion_blur = true;
+                continue;
+            }
+            if (arg == "--quantize") {
+                settings.quantize = true;
+                continue;
+            }
+            if (arg == "--bench-accel") {
+                settings.bench_accelerators = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                return false;
+            }
+            std::string const value{argv[++i]};
+            if (arg == "--integrator" && value == "whitted") {
+                settings.integrator = Integrator::Whitted;
+            } else if (arg == "--integrator" && value == "path") {
+                settings.integrator = Integrator::Path;
+            } else if (arg == "--sampler" && value == "sobol") {
+                settings.sample_pattern = SamplePattern::Sobol;
+            } else if (arg == "--sampler" && value == "random") {
+                settings.sample_pattern = SamplePattern::Random;
+            } else if (arg == "--aa") {
+                settings.antialiasing = std::stoul(value);
+            } else if (arg == "--spp") {
+                settings.samples = std::stoul(value);
+            } else if (arg == "--time") {
+                settings.time_budget = std::stod(value);
+            } else if (arg == "--shadow-samples") {
+                settings.shadows.samples = std::stoul(value);
+            } else if (arg == "--adaptive-threshold") {
+                settings.adaptive_threshold = std::stof(value);
+            } else if (arg == "--scale") {
+                settings.resolution_scale = std::stof(value);
+            } else if (arg == "--deadline") {
+                settings.deadline = std::stod(value);
+            } else if (arg == "--bounces") {
+                settings.max_bounces = std::stoul(value);
+            } else if (arg == "--denoise-passes") {
+                settings.denoise_settings.iterations = std::stoul(value);
+            } else if (arg == "--accel" && value == "list") {
+                settings.accelerator = AcceleratorType::List;
+            } else if (arg == "--accel" && value == "grid") {
+                settings.accelerator = AcceleratorType::Grid;
+            } else if (arg == "--accel" && value == "kdtree") {
+                settings.accelerator = AcceleratorType::KdTree;
+            } else if (arg == "--accel" && value == "bvh") {
+                settings.accelerator = AcceleratorType::Bvh;
+            } else if (arg == "--geometry-cache") {
+                settings.geometry_cache = std::stoul(value);
+            } else if (arg == "--frames") {
+                settings.frames = std::stoul(value);
+            } else if (arg == "--framebuffer") {
+                settings.framebuffer = value;
+            } else if (arg == "--scene") {
+                settings.scene = value;
+            } else if (arg == "--mesh") {
+                settings.mesh = value;
+            } else if (arg == "--points") {
+                settings.point_radius = std::stof(value);
+            } else if (arg == "--save-scene") {
+                settings.save_scene = value;
+            } else if (arg == "--banded") {
+                settings.banded = std::stoul(value);
+            } else if (arg == "--band-rows") {
+                settings.band_rows = std::stoul(value);
+            } else if (arg == "--fps") {
+                settings.fps = std::stoul(value);
+            } else if (arg == "--format" && value == "png") {
+                settings.output_format = OutputFormat::Png;
+            } else if (arg == "--format" && value == "rgb") {
+                settings.output_format = OutputFormat::Rgb;
+            } else if (arg == "--format" && value == "rgba") {
+                settings.output_format = OutputFormat::Rgba;
+            } else if (arg == "--format" && value == "y4m") {
+                settings.output_format = OutputFormat::Y4m;
+            } else if (arg == "-o") {
+                settings.output = value;
+            } else {
+                return false;
+            }
+        }
+    } catch (std::exception const&) {
+        return false;
+    }
+    bool const bounded = settings.samples > 0 || settings.time_budget > 0.0 || settings.deadline > 0.0;
+    bool const scaled = settings.resolution_scale > 0.0f && settings.resolution_scale <= 1.0f;
+    bool const streamed = settings.output_format != OutputFormat::Png || settings.output != "-";
+    bool const mapped = settings.framebuffer.empty() || settings.frames == 1;
+    bool const sourced = settings.scene.empty() || settings.mesh.empty();
+    bool const banded = settings.banded == 0 || (settings.band_rows > 0 && settings.frames == 1 &&
+                                                 settings.output_format == OutputFormat::Png &&
+                                                 (settings.integrator == Integrator::Whitted || settings.samples > 0));
+    return settings.antialiasing > 0 && settings.frames > 0 && settings.fps > 0 && bounded && scaled && streamed &&
+           mapped && banded && sourced;
+}
+
+//
+// Adaptive sampling
+//
+// The image is split into square tiles that each carry one sample per pixel per pass. Once a tile has
+// MinimumSamples its error, the root mean square standard error of the pixel luminances, is checked after every
+// pass and the tile retires when it falls below the threshold. A zero threshold keeps every tile active.
+//
+struct Tile {
+    size_t i0, j0, i1, j1;
+    size_t samples;
+    bool converged;
+};
+
+float tile_error(Accumulator const& accumulator, Tile const& tile)
+{
+    float total{0.0};
+    for (size_t i = tile.i0; i < tile.i1; i++) {
+        for (size_t j = tile.j0; j < tile.j1; j++) {
+            total += accumulator.luminance_variance(i, j);
+        }
+    }
+    return std::sqrt(total / ((tile.i1 - tile.i0) * (tile.j1 - tile.j0)));
+}
+
+struct RenderStats {
+    uint64_t rays;
+    double seconds;
+};
+
+// Adds samples pass by pass until the sample count or time budget runs out or every tile has converged. Passes
+// always complete so every pixel of a tile holds the same number of samples. The accumulator may be smaller than
+// the image, its pixels then cover 1 / resolution_scale image pixels each.
+template <size_t Width, size_t Height>
+RenderStats path_trace_progressive(Scene const& scene, RenderSettings const& settings, Accumulator& accumulator)
+{
+    constexpr size_t TileSize = 16;
+    constexpr size_t MinimumSamples = 8;
+
+    size_t const width = accumulator.get_width();
+    size_t const height = accumulator.get_height();
+    float const pixel_size = 1.0f / settings.resolution_scale;
+    std::vector<Tile> tiles{};
+    for (size_t i = 0; i < width; i += TileSize) {
+        for (size_t j = 0; j < height; j += TileSize) {
+            tiles.push_back({i, j, std::min(i + TileSize, width), std::min(j + TileSize, height), 0, false});
+        }
+    }
+    std::atomic<uint64_t> rays{0};
+
+    using clock = std::chrono::steady_clock;
+    auto const budget = std::chrono::duration<double>(settings.time_budget);
+    auto const start = clock::now();
+    for (size_t pass = 0; settings.samples == 0 || pass < settings.samples; pass++) {
+        std::vector<Tile*> active{};
+        for (auto& tile : tiles) {
+            if (!tile.converged) {
+                active.push_back(&tile);
+            }
+        }
+        if (active.empty()) {
+            break;
+        }
+
+        auto const pass_start = clock::now();
+        parallel_for(active.size(), [&](size_t k) {
+            Tile& tile = *active[k];
+            uint64_t const rays_before = traced_rays;
+            for (size_t i = tile.i0; i < tile.i1; i++) {
+                for (size_t j = tile.j0; j < tile.j1; j++) {
+                    Sampler sampler{settings.sample_pattern, static_cast<uint32_t>(i), static_cast<uint32_t>(j),
+                                    static_cast<uint32_t>(tile.samples)};
+                    auto const [u, v] = sampler.get_2d();
+                    float const x = (static_cast<float>(i) + u) * pixel_size - 0.5f;
+                    float const y = (static_cast<float>(j) + v) * pixel_size - 0.5f;
+                    Ray ray = primary_ray<Width, Height>(x, y);
+                    if (scene.has_motion()) {
+                        ray.time = sampler.get_1d();
+                    }
+                    Features features{};
+                    vec3 const color =
+                        path_trace(scene, ray, sampler, settings.max_bounces, settings.shadows, features);
+                    accumulator.add(i, j, color, features);
+                }
+            }
+            rays += traced_rays - rays_before;
+            tile.samples++;
+            if (settings.adaptive_threshold > 0.0 && tile.samples >= MinimumSamples) {
+                tile.converged = tile_error(accumulator, tile) < settings.adaptive_threshold;
+            }
+        });
+
+        if (settings.time_budget > 0.0) {
+            auto const now = clock::now();
+            // stop if another pass of the same length would overrun the budget
+            if ((now - start) + (now - pass_start) > budget) {
+                break;
+            }
+        }
+    }
+    return {rays, std::chrono::duration<double>(clock::now() - start).count()};
+}
+
+//
+// Deadline
+//
+// A one sample probe at quarter resolution measures rays per second, rays per sample and, when enabled, the
+// denoiser cost per pixel. The first candidate, in order of preference, that still affords MinimumSamples within
+// the remaining time picks resolution scale and bounce depth, after which the render runs until the time is spent.
+// Rays per sample are assumed to grow linearly with bounce depth.
+//
+template <size_t Width, size_t Height>
+RenderSettings
+plan_deadline(Scene const& scene, RenderSettings const& settings, std::chrono::steady_clock::time_point start)
+{
+    constexpr float ProbeScale = 0.25;
+    constexpr size_t MinimumSamples = 8;
+    constexpr double Margin = 0.9;
+
+    // keep the one-off blue-noise tile construction out of the measurement
+    BlueNoise::instance();
+
+    RenderSettings probe_settings = settings;
+    probe_settings.samples = 1;
+    probe_settings.time_budget = 0.0;
+    probe_settings.adaptive_threshold = 0.0;
+    probe_settings.resolution_scale = ProbeScale;
+    Accumulator probe{scaled_size(Width, ProbeScale), scaled_size(Height, ProbeScale)};
+    RenderStats const stats = path_trace_progressive<Width, Height>(scene, probe_settings, probe);
+    double const probe_pixels = static_cast<double>(probe.get_width() * probe.get_height());
+    double const rays_per_second = std::max(1.0, static_cast<double>(stats.rays)) / std::max(1e-6, stats.seconds);
+    double const rays_per_sample = std::max(1.0, static_cast<double>(stats.rays) / probe_pixels);
+
+    double denoise_seconds_per_pixel{0.0};
+    if (settings.denoise) {
+        auto const denoise_start = std::chrono::steady_clock::now();
+        Denoiser denoiser{probe};
+        denoiser.run(settings.denoise_settings);
+        std::chrono::duration<double> const denoise_time = std::chrono::steady_clock::now() - denoise_start;
+        denoise_seconds_per_pixel = denoise_time.count() / probe_pixels;
+    }
+    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+    double const remaining = (settings.deadline - elapsed.count()) * Margin;
+
+    size_t const bounces = std::max<size_t>(1, settings.max_bounces);
+    std::array<std::pair<float, size_t>, 6> const candidates{{
+        {1.0f, bounces},
+        {1.0f, std::max<size_t>(1, bounces / 2)},
+        {0.5f, bounces},
+        {0.5f, std::max<size_t>(1, bounces / 2)},
+        {0.25f, std::max<size_t>(1, bounces / 2)},
+        {0.25f, 1},
+    }};
+    RenderSettings planned = settings;
+    for (auto const& [scale, depth] : candidates) {
+        double const pixels = static_cast<double>(scaled_size(Width, scale) * scaled_size(Height, scale));
+        double const sample_rays = 1.0 + (rays_per_sample - 1.0) * (depth + 1) / (bounces + 1);
+        double const guide_seconds = (scale < 1.0f) ? Width * Height / rays_per_second : 0.0;
+        double const trace_seconds = remaining - pixels * denoise_seconds_per_pixel - guide_seconds;
+        double const samples = trace_seconds * rays_per_second / (pixels * sample_rays);
+        planned.resolution_scale = scale;
+        planned.max_bounces = depth;
+        if (samples >= MinimumSamples) {
+            break;
+        }
+    }
+    double const pixels = scaled_size(Width, planned.resolution_scale) * scaled_size(Height, planned.resolution_scale);
+    planned.samples = 0;
+    planned.time_budget = std::max(1e-3, remaining - pixels * denoise_seconds_per_pixel);
+
+    std::cerr << "deadline: " << rays_per_second / 1e6 << " Mrays/s, rendering at scale "
+              << planned.resolution_scale << " with " << planned.max_bounces << " bounces\n";
+    return planned;
+}
+
+//
+// Benchmarks
+//
+// Times construction and traversal of every acceleration structure on three synthetic scenes: a uniform sphere
+// field, one packed into a few gaussian clusters, the case that defeats uniform subdivision, and a building of
+// axis-aligned wall quads and furniture boxes. Every structure traces the same random rays so the hit counts
+// double as a consistency check, as they do for the slab test kernel against a naive one. Given a mesh they run
+// on it instead, once at full precision and once quantized, leaving out the list which would take hours.
+//
+enum class BenchmarkScene { Uniform, Clustered, Architecture, Mesh, QuantizedMesh };
+
+// Rooms stacked in a cube, each with two walls and a box of furniture, on storeys separated by slabs spanning the
+// whole building. Walls and slabs are axis-aligned quads.
+void populate_architecture_scene(Scene& scene)
+{
+    constexpr size_t Rooms = 10;
+    constexpr float RoomSize = 100.0;
+
+    Rng rng{4};
+    Material material;
+    material.color = {1.0, 1.0, 1.0};
+    material.diffuse = 1.0;
+    auto const push_quad = [&](vec3 const& corner, vec3 const& edge_u, vec3 const& edge_v) {
+        scene.push_object(Quad({{corner, corner + edge_u, corner + edge_u + edge_v, corner + edge_v}}, material));
+    };
+    for (size_t z = 0; z < Rooms; z++) {
+        push_quad({0, 0, z * RoomSize}, {Rooms * RoomSize, 0, 0}, {0, Rooms * RoomSize, 0});
+    }
+    for (size_t x = 0; x < Rooms; x++) {
+        for (size_t y = 0; y < Rooms; y++) {
+            for (size_t z = 0; z < Rooms; z++) {
+                vec3 const corner{x * RoomSize, y * RoomSize, z * RoomSize};
+                push_quad(corner, {RoomSize, 0, 0}, {0, 0, RoomSize});
+                push_quad(corner, {0, RoomSize, 0}, {0, 0, RoomSize});
+
+                vec3 const size{(0.1f + 0.3f * rng.next_float()) * RoomSize,
+                                (0.1f + 0.3f * rng.next_float()) * RoomSize,
+                                (0.1f + 0.3f * rng.next_float()) * RoomSize};
+                vec3 const low = corner + vec3{rng.next_float() * (RoomSize - size[0]),
+                                               rng.next_float() * (RoomSize - size[1]), 0};
+                scene.push_object(Box(low, low + size, material));
+            }
+        }
+    }
+}
+
+void populate_benchmark_scene(Scene& scene, BenchmarkScene layout, Mesh const& mesh)
+{
+    constexpr size_t Count = 10000;
+    constexpr size_t Clusters = 8;
+    constexpr float Extent = 1000.0;
+
+    if (layout == BenchmarkScene::Architecture) {
+        populate_architecture_scene(scene);
+        return;
+    }
+    if (layout == BenchmarkScene::Mesh) {
+        std::cerr << "mesh storage " << (mesh.memory() >> 10) << " KiB\n";
+        scene.push_mesh(Mesh{mesh});
+        return;
+    }
+    if (layout == BenchmarkScene::QuantizedMesh) {
+        QuantizedMesh quantized{mesh};
+        std::cerr << "quantized storage " << (quantized.memory() >> 10) << " KiB, "
+                  << 100.0 * quantized.memory() / std::max<size_t>(1, mesh.memory())
+                  << "% of full precision, error below " << quantized.max_error() << "\n";
+        scene.push_mesh(std::move(quantized));
+        return;
+    }
+    bool const clustered = layout == BenchmarkScene::Clustered;
+    Rng rng{clustered ? 2u : 1u};
+    std::array<vec3, Clusters> centers{};
+    for (auto& center : centers) {
+        center = {(rng.next_float() - 0.5f) * Extent, (rng.next_float() - 0.5f) * Extent,
+                  (rng.next_float() - 0.5f) * Extent};
+    }
+    Material material;
+    material.color = {1.0, 1.0, 1.0};
+    material.diffuse = 1.0;
+    for (size_t k = 0; k < Count; k++) {
+        vec3 position{};
+        if (clustered) {
+            // Box-Muller, two gaussians per draw
+            for (size_t axis = 0; axis < 3; axis++) {
+                float const radius = std::sqrt(-2.0f * std::log(1.0f - rng.next_float()));
+                position[axis] = 20.0f * radius * std::cos(2.0f * pi * rng.next_float());
+            }
+            position += centers[k % Clusters];
+        } else {
+            position = {(rng.next_float() - 0.5f) * Extent, (rng.next_float() - 0.5f) * Extent,
+                        (rng.next_float() - 0.5f) * Extent};
+        }
+        scene.push_object(Sphere(position, 1.0f + 2.0f * rng.next_float(), material));
+    }
+}
+
+// Textbook slab test for comparison with AABB::hit, dividing by the direction and ordering the slab distances with
+// a branch on every axis.
+bool naive_slab_test(AABB const& box, Ray const& ray)
+{
+    float near{0.0};
+    float far{ray.t};
+    for (size_t axis = 0; axis < 3; axis++) {
+        float t0 = (box.min[axis] - ray.origin[axis]) / ray.direction[axis];
+        float t1 = (box.max[axis] - ray.origin[axis]) / ray.direction[axis];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        near = t0 > near ? t0 : near;
+        far = t1 < far ? t1 : far;
+        if (near > far) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Every ray against the bounds of the first BoxCount objects, with the naive test and with the kernel.
+void benchmark_slab_tests(char const* scene_name, Scene const& scene, std::vector<Ray> const& rays)
+{
+    constexpr size_t BoxCount = 1024;
+    constexpr size_t Chunk = 1024;
+
+    std::vector<AABB> boxes{};
+    for (size_t k = 0; k < std::min(BoxCount, scene.get_objects().size()); k++) {
+        boxes.push_back(scene.get_objects()[k]->bounds());
+    }
+    auto const run = [&](auto const& test) {
+        std::atomic<size_t> hits{0};
+        auto const start = std::chrono::steady_clock::now();
+        parallel_for((rays.size() + Chunk - 1) / Chunk, [&](size_t chunk) {
+            size_t local_hits{0};
+            for (size_t k = chunk * Chunk; k < std::min(rays.size(), (chunk + 1) * Chunk); k++) {
+                for (auto const& box : boxes) {
+                    local_hits += test(box, rays[k]);
+                }
+            }
+            hits += local_hits;
+        });
+        std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+        return std::pair<double, size_t>{rays.size() * boxes.size() / elapsed.count() * 1e-6, hits};
+    };
+    auto const [naive_rate, naive_hits] = run(naive_slab_test);
+    auto const [kernel_rate, kernel_hits] = run([](AABB const& box, Ray const& ray) { return box.hit(ray); });
+    std::cerr << scene_name << " slab test: naive " << naive_rate << " Mtests/s, " << naive_hits << " hits, kernel "
+              << kernel_rate << " Mtests/s, " << kernel_hits << " hits\n";
+}
+
+void benchmark_accelerators(RenderSettings const& settings)
+{
+    constexpr size_t RayCount = 1 << 14;
+    constexpr std::array<std::pair<AcceleratorType, char const*>, 4> types{{
+        {AcceleratorType::List, "list"},
+        {AcceleratorType::Grid, "grid"},
+        {AcceleratorType::KdTree, "kdtree"},
+        {AcceleratorType::Bvh, "bvh"},
+    }};
+
+    std::vector<std::pair<BenchmarkScene, char const*>> scenes{{
+        {BenchmarkScene::Uniform, "uniform     "},
+        {BenchmarkScene::Clustered, "clustered   "},
+        {BenchmarkScene::Architecture, "architecture"},
+    }};
+    Mesh mesh{};
+    if (!settings.mesh.empty()) {
+        mesh = load_mesh(settings.mesh);
+        scenes = {{BenchmarkScene::Mesh, "mesh        "}, {BenchmarkScene::QuantizedMesh, "quantized   "}};
+    }
+
+    for (auto const& [layout, scene_name] : scenes) {
+        Scene scene{};
+        populate_benchmark_scene(scene, layout, mesh);
+        AABB const& bounds = scene.get_bounds();
+
+        std::vector<Ray> rays(RayCount);
+        Rng rng{3};
+        for (auto& ray : rays) {
+            vec3 origin{};
+            for (size_t axis = 0; axis < 3; axis++) {
+                origin[axis] = bounds.min[axis] + rng.next_float() * (bounds.max[axis] - bounds.min[axis]);
+            }
+            float const z = 1.0f - 2.0f * rng.next_float();
+            float const r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            float const phi = 2.0f * pi * rng.next_float();
+            ray = Ray(origin, {r * std::cos(phi), r * std::sin(phi), z});
+        }
+
+        benchmark_slab_tests(scene_name, scene, rays);
+        for (auto const& [type, name] : types) {
+            if (type == AcceleratorType::List && !settings.mesh.empty()) {
+                continue;
+            }
+            auto const build_start = std::chrono::steady_clock::now();
+            scene.build(type);
+            auto const trace_start = std::chrono::steady_clock::now();
+            std::atomic<size_t> hits{0};
+            parallel_for(RayCount / 1024, [&](size_t chunk) {
+                size_t local_hits{0};
+                for (size_t k = chunk * 1024; k < (chunk + 1) * 1024; k++) {
+                    Ray ray = rays[k];
+                    Hit hit{};
+                    local_hits += scene.intersect(ray, hit);
+                }
+                hits += local_hits;
+            });
+            auto const end = std::chrono::steady_clock::now();
+            double const build_ms = std::chrono::duration<double, std::milli>(trace_start - build_start).count();
+            double const trace_seconds = std::chrono::duration<double>(end - trace_start).count();
+            std::cerr << scene_name << " " << name << ": build " << build_ms << " ms, "
+                      << RayCount / trace_seconds * 1e-6 << " Mrays/s, " << hits << " hits\n";
+        }
+    }
+}
+
+//
+// Animation
+//
+// The default scene is keyframed over normalized time, zero to one across the whole sequence, with the matte
+// sphere circling above the mirrors and returning to its start so sequences loop. The shutter stays open for half
+// a frame interval, a single frame therefore blurs over the first half of the path.
+//
+struct Keyframe {
+    float time;
+    vec3 position;
+};
+
+vec3 keyframe_position(std::vector<Keyframe> const& keyframes, float time)
+{
+    auto const next = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+                                       [](float t, Keyframe const& keyframe) { return t < keyframe.time; });
+    if (next == keyframes.begin()) {
+        return keyframes.front().position;
+    }
+    if (next == keyframes.end()) {
+        return keyframes.back().position;
+    }
+    Keyframe const& previous = *(next - 1);
+    float const w = (time - previous.time) / (next->time - previous.time);
+    return previous.position * (1.0f - w) + next->position * w;
+}
+
+void push_default_lights(Scene& scene, RenderSettings const& settings)
+{
+    if (settings.area_lights) {
+        scene.push_light(SphereLight({-500, 0, 100}, 60, {1, 0, 0}));
+        scene.push_light(SphereLight({+500, 0, 100}, 60, {0, 1, 0}));
+        scene.push_light(SphereLight({0, +500, -100}, 60, {0, 0, 1}));
+        scene.push_light(SphereLight({0, -500, -100}, 60, {0, 1, 1}));
+        scene.push_light(SphereLight({0, 0, 100}, 60, {1, 1, 0}));
+    } else {
+        scene.push_light(Light({-500, 0, 100}, {1, 0, 0}));
+        scene.push_light(Light({+500, 0, 100}, {0, 1, 0}));
+        scene.push_light(Light({0, +500, -100}, {0, 0, 1}));
+        scene.push_light(Light({0, -500, -100}, {0, 1, 1}));
+        scene.push_light(Light({0, 0, 100}, {1, 1, 0}));
+    }
+}
+
+void populate_default_scene(Scene& scene, RenderSettings const& settings, float time, float shutter)
+{
+    std::vector<Keyframe> const matte_keyframes{{
+        {0.0f, {0, 100, 0}},
+        {0.25f, {80, 130, 0}},
+        {0.5f, {0, 160, 0}},
+        {0.75f, {-80, 130, 0}},
+        {1.0f, {0, 100, 0}},
+    }};
 
     Material mirror;
     mirror.color = {0.9, 1.0, 0.9};
@@ -452,21 +5397,332 @@ int main()
     matte.diffuse = 0.7;
     matte.reflect = 0.2;
 
-    Scene scene{};
-    scene.push_light(Light({-500, 0, 100}, {1, 0, 0}));
-    scene.push_light(Light({+500, 0, 100}, {0, 1, 0}));
-    scene.push_light(Light({0, +500, -100}, {0, 0, 1}));
-    scene.push_light(Light({0, -500, -100}, {0, 1, 1}));
-    scene.push_light(Light({0, 0, 100}, {1, 1, 0}));
+    push_default_lights(scene, settings);
     scene.push_object(Sphere({-87, -50, 0}, 100, mirror));
     scene.push_object(Sphere({+87, -50, 0}, 100, mirror));
-    scene.push_object(Sphere({0, 100, 0}, 100, matte));
-    scene.push_object(Triangle({{{-1000, -1000, 0}, {1000, -1000, 0}, {1000, 1000, 0}}}, matte));
-    Image<Width, Height, ImageChannelType::RGBA> img{};
-    for (size_t i = 0; i < Width; i++) {
-        for (size_t j = 0; j < Height; j++) {
-            img.set(i, j, to_uints(ray_trace<Width, Height, Depth>(scene, i, j)));
+    vec3 const matte_position = keyframe_position(matte_keyframes, time);
+    if (settings.motion_blur) {
+        vec3 const shutter_close = keyframe_position(matte_keyframes, time + shutter);
+        scene.push_object(MovingSphere(matte_position, shutter_close, 100, matte));
+    } else {
+        scene.push_object(Sphere(matte_position, 100, matte));
+    }
+    if (settings.plane) {
+        scene.push_object(Plane({0, 0, 0}, {0, 0, 1}, matte));
+    } else {
+        scene.push_object(Triangle({{{-1000, -1000, 0}, {1000, -1000, 0}, {1000, 1000, 0}}}, matte));
+    }
+    scene.get_geometry_cache().set_capacity(settings.geometry_cache << 20);
+    if (settings.patch) {
+        // rippled sheet across the bottom of the image, arched towards the camera
+        std::array<vec3, 16> control_points{};
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                float const arch = (i == 1 || i == 2) && (j == 1 || j == 2) ? -120.0f : -20.0f;
+                control_points[i * 4 + j] = {-250.0f + 500.0f * i / 3.0f, -160.0f - 90.0f * j / 3.0f, arch};
+            }
+        }
+        scene.push_object(Patch(control_points, 4.0f, 6.0f, 256, matte, scene.get_geometry_cache()));
+    }
+}
+
+// Imported mesh under the default lights, scaled and centered to fill the view. Point clouds, and meshes when a
+// point radius is set, become one sphere per vertex.
+void populate_mesh_scene(Scene& scene, RenderSettings const& settings)
+{
+    constexpr float ViewSize = 400;
+
+    auto const load_start = std::chrono::steady_clock::now();
+    Mesh mesh = load_mesh(settings.mesh);
+    std::chrono::duration<double, std::milli> const load_time = std::chrono::steady_clock::now() - load_start;
+    std::cerr << settings.mesh << ": " << mesh.positions.size() << " vertices, " << mesh.triangles.size()
+              << " triangles, " << mesh.quads.size() << " quads loaded in " << load_time.count() << " ms\n";
+
+    AABB const box = mesh.bounds();
+    vec3 const center = 0.5f * (box.min + box.max);
+    vec3 const extent = box.max - box.min;
+    float const scale = ViewSize / std::max({extent[0], extent[1], 1e-6f});
+    for (auto& position : mesh.positions) {
+        position = scale * (position - center);
+    }
+    mesh.material.color = {1.0, 0.8, 0.6};
+    mesh.material.ambient = 0.3;
+    mesh.material.diffuse = 0.7;
+    push_default_lights(scene, settings);
+    if (settings.point_radius > 0.0f || (mesh.triangles.empty() && mesh.quads.empty())) {
+        float const radius = settings.point_radius > 0.0f ? settings.point_radius : 1.0f;
+        for (auto const& position : mesh.positions) {
+            scene.push_object(Sphere(position, radius, mesh.material));
+        }
+    } else if (settings.quantize) {
+        QuantizedMesh quantized{mesh};
+        std::cerr << "mesh storage: " << (quantized.memory() >> 10) << " KiB quantized, " << (mesh.memory() >> 10)
+                  << " KiB at full precision\n";
+        scene.push_mesh(std::move(quantized));
+    } else {
+        scene.push_mesh(std::move(mesh));
+    }
+}
+
+// The scene file or mesh when one is given, neither is animated, the default scene otherwise.
+void populate_scene(Scene& scene, RenderSettings const& settings, float time, float shutter)
+{
+    if (!settings.scene.empty()) {
+        scene.load(settings.scene);
+    } else if (!settings.mesh.empty()) {
+        populate_mesh_scene(scene, settings);
+    } else {
+        populate_default_scene(scene, settings, time, shutter);
+    }
+}
+
+std::unique_ptr<Scene> build_frame_scene(RenderSettings const& settings, size_t frame)
+{
+    float const interval = 1.0f / static_cast<float>(settings.frames);
+    auto scene = std::make_unique<Scene>();
+    populate_scene(*scene, settings, frame * interval, 0.5f * interval);
+    scene->build(settings.accelerator);
+    return scene;
+}
+
+template <size_t Width, size_t Height, size_t Depth>
+void render_frame(Scene const& scene, RenderSettings const& settings, Image<Width, Height, ImageChannelType::RGBA>& img,
+                  std::chrono::steady_clock::time_point start)
+{
+    if (settings.integrator == Integrator::Whitted && settings.antialiasing == 1) {
+        for (size_t i = 0; i < Width; i++) {
+            for (size_t j = 0; j < Height; j++) {
+                Sampler sampler{settings.sample_pattern, static_cast<uint32_t>(i), static_cast<uint32_t>(j), 0};
+                img.set(i, j, to_uints(ray_trace<Width, Height, Depth>(scene, i, j, sampler, settings.shadows)));
+            }
+        }
+    } else if (settings.integrator == Integrator::Whitted) {
+        parallel_for(Width, [&](size_t i) {
+            for (size_t j = 0; j < Height; j++) {
+                vec3 color{};
+                for (size_t s = 0; s < settings.antialiasing; s++) {
+                    Sampler sampler{settings.sample_pattern, static_cast<uint32_t>(i), static_cast<uint32_t>(j),
+                                    static_cast<uint32_t>(s)};
+                    auto const [u, v] = sampler.get_2d();
+                    float const x = static_cast<float>(i) + u - 0.5f;
+                    float const y = static_cast<float>(j) + v - 0.5f;
+                    color += ray_trace<Width, Height, Depth>(scene, x, y, sampler, settings.shadows);
+                }
+                img.set(i, j, to_uints(color * (1.0f / settings.antialiasing)));
+            }
+        });
+    } else {
+        RenderSettings planned = settings;
+        if (settings.deadline > 0.0) {
+            planned = plan_deadline<Width, Height>(scene, settings, start);
+        }
+        float const scale = planned.resolution_scale;
+        std::vector<Features> guide{};
+        if (scale < 1.0f) {
+            auto const guide_start = std::chrono::steady_clock::now();
+            guide = trace_guide<Width, Height>(scene);
+            // the planned budget starts after the guide pass, whatever it actually took
+            std::chrono::duration<double> const guide_time = std::chrono::steady_clock::now() - guide_start;
+            if (planned.deadline > 0.0) {
+                planned.time_budget = std::max(1e-3, planned.time_budget - guide_time.count());
+            }
+        }
+        Accumulator accumulator{scaled_size(Width, scale), scaled_size(Height, scale)};
+        RenderStats const stats = path_trace_progressive<Width, Height>(scene, planned, accumulator);
+        if (planned.denoise) {
+            Denoiser denoiser{accumulator};
+            denoiser.run(planned.denoise_settings);
+            resolve_image(img, denoiser, accumulator, guide, scale);
+        } else {
+            resolve_image(img, accumulator, accumulator, guide, scale);
+        }
+        std::cerr << accumulator.mean_sample_count() << " samples per pixel on average, "
+                  << stats.rays / std::max(1e-6, stats.seconds) / 1e6 << " Mrays/s\n";
+    }
+}
+
+// Inserts the zero padded frame number before the extension, frame 7 of "out.png" is written to "out_0007.png".
+std::string numbered_output(std::string const& output, size_t frame)
+{
+    std::string number = std::to_string(frame);
+    number.insert(0, number.size() < 4 ? 4 - number.size() : 0, '0');
+    size_t const dot = output.find_last_of('.');
+    size_t const slash = output.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return output + "_" + number;
+    }
+    return output.substr(0, dot) + "_" + number + output.substr(dot);
+}
+
+// Three stage pipeline: while frame n is traced on the worker pool, the scene of frame n + 1 is populated and its
+// accelerator built on one thread and frame n - 1 is compressed to png or appended to the frame stream on another.
+// Two images alternate so the encoder never reads the frame being traced. Deadlines apply per frame.
+template <size_t Width, size_t Height, size_t Depth> void render_sequence(RenderSettings const& settings)
+{
+    std::array<Image<Width, Height, ImageChannelType::RGBA>, 2> images{};
+    std::unique_ptr<FrameStream> stream{};
+    if (settings.output_format != OutputFormat::Png) {
+        stream = std::make_unique<FrameStream>(settings.output, settings.output_format, Width, Height, settings.fps);
+    }
+    auto const start = std::chrono::steady_clock::now();
+    std::unique_ptr<Scene> scene = build_frame_scene(settings, 0);
+    std::thread encoder{};
+    for (size_t frame = 0; frame < settings.frames; frame++) {
+        std::unique_ptr<Scene> next_scene{};
+        std::thread updater{};
+        if (frame + 1 < settings.frames) {
+            updater = std::thread([&settings, &next_scene, frame]() {
+                next_scene = build_frame_scene(settings, frame + 1);
+            });
+        }
+        auto& img = images[frame % 2];
+        render_frame<Width, Height, Depth>(*scene, settings, img, std::chrono::steady_clock::now());
+        if (encoder.joinable()) {
+            encoder.join();
+        }
+        encoder = std::thread([&img, &settings, &stream, frame]() {
+            if (stream) {
+                stream->write(img);
+            } else {
+                img.save(numbered_output(settings.output, frame));
+            }
+        });
+        if (updater.joinable()) {
+            updater.join();
+        }
+        scene = std::move(next_scene);
+    }
+    if (encoder.joinable()) {
+        encoder.join();
+    }
+    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << settings.frames << " frames in " << elapsed.count() << " seconds, "
+              << settings.frames / elapsed.count() << " frames/s\n";
+}
+
+//
+// Banded rendering
+//
+// Renders an output of any size over the film of the Width x Height camera, band_rows image rows at a time. Each
+// band is traced, handed to the png encoder and reused for the next, so peak memory is one band plus the encoder
+// state. With a framebuffer file bands are traced straight into its mapping instead and there is no encoder.
+// Image rows follow the first pixel index like everywhere else. Path tracing takes a fixed sample count per pixel
+// since adaptive sampling, upscaling and denoising all need the whole image.
+//
+template <size_t Width, size_t Height, size_t Depth>
+void render_banded(Scene const& scene, RenderSettings const& settings)
+{
+    size_t const size = settings.banded;
+    float const pixel_size = static_cast<float>(Width) / static_cast<float>(size);
+    bool const whitted = settings.integrator == Integrator::Whitted;
+    size_t const samples = whitted ? settings.antialiasing : settings.samples;
+
+    auto const start = std::chrono::steady_clock::now();
+    std::unique_ptr<MappedFramebuffer> framebuffer{};
+    std::unique_ptr<PngRowWriter> writer{};
+    std::vector<uint8_t> band{};
+    if (settings.framebuffer.empty()) {
+        writer = std::make_unique<PngRowWriter>(settings.output, size, size);
+        band.resize(settings.band_rows * size * 4);
+    } else {
+        framebuffer = std::make_unique<MappedFramebuffer>(settings.framebuffer, size, size, ImageChannelType::RGBA);
+    }
+    for (size_t row0 = 0; row0 < size; row0 += settings.band_rows) {
+        size_t const rows = std::min(settings.band_rows, size - row0);
+        uint8_t* const pixels = framebuffer ? framebuffer->row(row0) : band.data();
+        parallel_for(rows, [&](size_t r) {
+            size_t const i = row0 + r;
+            for (size_t j = 0; j < size; j++) {
+                vec3 color{};
+                for (size_t s = 0; s < samples; s++) {
+                    Sampler sampler{settings.sample_pattern, static_cast<uint32_t>(i), static_cast<uint32_t>(j),
+                                    static_cast<uint32_t>(s)};
+                    // a single whitted sample goes through the pixel center like the full frame renderer
+                    auto const [u, v] = (whitted && samples == 1) ? std::array<float, 2>{0.5f, 0.5f}
+                                                                  : sampler.get_2d();
+                    float const x = (static_cast<float>(i) + u) * pixel_size - 0.5f;
+                    float const y = (static_cast<float>(j) + v) * pixel_size - 0.5f;
+                    if (whitted) {
+                        color += ray_trace<Width, Height, Depth>(scene, x, y, sampler, settings.shadows);
+                    } else {
+                        Ray ray = primary_ray<Width, Height>(x, y);
+                        if (scene.has_motion()) {
+                            ray.time = sampler.get_1d();
+                        }
+                        Features features{};
+                        color += path_trace(scene, ray, sampler, settings.max_bounces, settings.shadows, features);
+                    }
+                }
+                auto const pixel = to_uints(color * (1.0f / samples));
+                std::memcpy(&pixels[(r * size + j) * 4], pixel.data(), 4);
+            }
+        });
+        if (writer) {
+            writer->write(band, rows);
         }
     }
-    img.save("example.png");
+    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << size << " x " << size << " in bands of " << settings.band_rows << " rows";
+    if (framebuffer) {
+        std::cerr << " into " << settings.framebuffer;
+    } else {
+        std::cerr << " (" << (band.size() >> 10) << " KiB)";
+    }
+    std::cerr << ", " << size * size / elapsed.count() / 1e6 << " Mpixels/s\n";
+}
+
+//
+// Main
+//
+int main(int argc, char** argv)
+{
+    constexpr int Width = 512;
+    constexpr int Height = 512;
+    constexpr int Depth = 10;
+
+    auto const start = std::chrono::steady_clock::now();
+    RenderSettings settings{};
+    if (!parse_arguments(argc, argv, settings)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (settings.bench_accelerators) {
+        benchmark_accelerators(settings);
+        return 0;
+    }
+    if (settings.frames > 1) {
+        render_sequence<Width, Height, Depth>(settings);
+        return 0;
+    }
+
+    Scene scene{};
+    populate_scene(scene, settings, 0.0f, 0.5f);
+    if (!settings.save_scene.empty()) {
+        scene.save(settings.save_scene);
+        return 0;
+    }
+    scene.build(settings.accelerator);
+    if (settings.banded > 0) {
+        render_banded<Width, Height, Depth>(scene, settings);
+        return 0;
+    }
+    using FrameImage = Image<Width, Height, ImageChannelType::RGBA>;
+    auto img = settings.framebuffer.empty() ? std::make_unique<FrameImage>()
+                                            : std::make_unique<FrameImage>(settings.framebuffer);
+    render_frame<Width, Height, Depth>(scene, settings, *img, start);
+    // a mapped framebuffer is the output itself
+    if (settings.framebuffer.empty() && settings.output_format == OutputFormat::Png) {
+        img->save(settings.output);
+    } else if (settings.framebuffer.empty()) {
+        FrameStream{settings.output, settings.output_format, Width, Height, settings.fps}.write(*img);
+    }
+    if (scene.has_patches()) {
+        GeometryCache const& cache = scene.get_geometry_cache();
+        std::cerr << "geometry cache: " << cache.get_misses() << " tessellations, " << cache.get_evictions()
+                  << " evictions, " << (cache.get_size() >> 10) << " KiB resident\n";
+    }
+    if (settings.deadline > 0.0) {
+        std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "finished in " << elapsed.count() << " of " << settings.deadline << " seconds\n";
+    }
 }